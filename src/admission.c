@@ -0,0 +1,62 @@
+#include <stdatomic.h>
+#include "admission.h"
+
+static const char *kind_names[ADMIT_KINDS] = {"connections", "sessions", "db"};
+
+static AdmissionLimits limits;
+static atomic_int in_use[ADMIT_KINDS];
+static atomic_long refused[ADMIT_KINDS];
+
+void admission_configure(const AdmissionLimits *config)
+{
+  limits = *config;
+}
+
+int admission_acquire(AdmissionKind kind)
+{
+  int cap = limits.limit[kind];
+  int current = atomic_load(&in_use[kind]);
+  do
+  {
+    if (cap > 0 && current >= cap)
+    {
+      atomic_fetch_add(&refused[kind], 1);
+      return 0;
+    }
+  } while (!atomic_compare_exchange_weak(&in_use[kind], &current, current + 1));
+  return 1;
+}
+
+void admission_release(AdmissionKind kind)
+{
+  atomic_fetch_sub(&in_use[kind], 1);
+}
+
+int admission_in_use(AdmissionKind kind)
+{
+  return atomic_load(&in_use[kind]);
+}
+
+void admission_add(AdmissionKind kind)
+{
+  atomic_fetch_add(&in_use[kind], 1);
+}
+
+void admission_refuse(Message *message, AdmissionKind kind)
+{
+  char text[96];
+  snprintf(text, sizeof(text), "Server busy (%s limit reached), retry in %d ms", kind_names[kind], limits.retry_after_ms);
+  message_set_text(message, SERVICE_UNAVAILABLE, text);
+}
+
+void admission_report(FILE *out)
+{
+  fprintf(out, "admission:");
+  for (int kind = 0; kind < ADMIT_KINDS; kind++)
+  {
+    fprintf(out, " %s=%d/%d refused_%s=%ld", kind_names[kind], atomic_load(&in_use[kind]), limits.limit[kind],
+            kind_names[kind], atomic_load(&refused[kind]));
+  }
+  fprintf(out, " retry_after_ms=%d\n", limits.retry_after_ms);
+  fflush(out);
+}
@@ -0,0 +1,39 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdio.h>
+#include "model/message.h"
+
+// Admission control. Connections, game sessions and database requests in
+// progress each have a cap; work over a cap is refused straight away with a
+// SERVICE_UNAVAILABLE reply telling the client when to retry, so an overload
+// costs the newcomers a fast 503 instead of slowing down everyone admitted.
+typedef enum
+{
+  ADMIT_CONNECTION,
+  ADMIT_SESSION,
+  ADMIT_DATABASE, // Requests running at once; each loop runs one at a time, so at most one per loop
+  ADMIT_KINDS,
+} AdmissionKind;
+
+typedef struct
+{
+  int limit[ADMIT_KINDS]; // 0 = no cap
+  int retry_after_ms;     // Hint sent with every refusal
+} AdmissionLimits;
+
+// Call before any loop starts
+void admission_configure(const AdmissionLimits *config);
+// Returns 1 and counts one more in use, or 0 (and counts a refusal) when at
+// the cap. Every successful acquire is paired with one admission_release.
+int admission_acquire(AdmissionKind kind);
+void admission_release(AdmissionKind kind);
+int admission_in_use(AdmissionKind kind);
+// Count one more in use whatever the cap: taken over from a previous process
+void admission_add(AdmissionKind kind);
+// Turn message into the SERVICE_UNAVAILABLE reply for a refusal of kind
+void admission_refuse(Message *message, AdmissionKind kind);
+// One line of metrics: in use, cap and refusals so far for each kind
+void admission_report(FILE *out);
+
+#endif
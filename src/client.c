@@ -5,6 +5,7 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
 #include <pthread.h>
 #include <fcntl.h>
 #include <stdbool.h>
@@ -59,6 +60,7 @@ static int current_col = 0;
 static GtkLabel *game_grid[MAX_ATTEMPTS][WORD_LENGTH];
 static GtkEntry *word_entry;
 static GtkWidget *submit_button;
+static GtkWidget *hint_button;
 static GtkEntry *hint_entry; // Biến mới để hiển thị từ xáo trộn
 // static int player_number = 0;
 // static GtkWidget *game_status_label;
@@ -95,8 +97,10 @@ gboolean timer_func(gpointer data)
 
     // Gửi thông báo thua lên Server
     Message msg;
+    SessionRequest request = {.session_id = game_session_id};
+    snprintf(request.player, sizeof(request.player), "%s", client_name);
     msg.message_type = GAME_TIMEOUT;
-    sprintf(msg.payload, "%d|%s", game_session_id, client_name);
+    encode_session_request(&msg, &request);
     queue_push(&send_queue, &msg);
 
     timer_id = 0;
@@ -104,11 +108,18 @@ gboolean timer_func(gpointer data)
   }
 }
 
-// Hàm khởi động lại Timer (Gọi khi đổi lượt)
-void reset_timer()
+// Dừng Timer (Khi tới lượt đối thủ)
+void stop_timer()
 {
   if (timer_id > 0)
     g_source_remove(timer_id);
+  timer_id = 0;
+}
+
+// Hàm khởi động lại Timer (Gọi khi tới lượt mình)
+void reset_timer()
+{
+  stop_timer();
   time_left = 10;
   gtk_label_set_text(timer_label, "Time: 10s");
   timer_id = g_timeout_add_seconds(1, timer_func, NULL);
@@ -168,31 +179,67 @@ int queue_pop(MessageQueue *queue, Message *msg)
 
 int send_message(int sockfd, const Message *msg)
 {
-  int bytes_sent = send(sockfd, msg, sizeof(Message), 0);
-  if (bytes_sent < 0)
+  char frame[MESSAGE_MAX_FRAME];
+  size_t len = message_encode(msg, frame);
+  size_t sent = 0;
+  while (sent < len)
   {
-    perror("Send failed");
-    return -1;
+    ssize_t bytes_sent = send(sockfd, frame + sent, len - sent, 0);
+    if (bytes_sent < 0)
+    {
+      perror("Send failed");
+      return -1;
+    }
+    sent += (size_t)bytes_sent;
   }
-  printf("Sent message of type %d, content: %s\n", msg->message_type, msg->payload);
+  if (message_is_binary(msg->message_type))
+    printf("Sent message of type %d, %zu bytes\n", msg->message_type, len);
+  else
+    printf("Sent message of type %d, content: %s\n", msg->message_type, msg->payload);
   return 0;
 }
 
+// Bytes received but not yet decoded; one recv() may hold several frames or part of one
+static char recv_buffer[4 * MESSAGE_MAX_FRAME];
+static size_t recv_length = 0;
+
+// True if a whole frame is already buffered, so receive_message will not block
+bool has_buffered_message()
+{
+  Message msg;
+  return message_decode(recv_buffer, recv_length, &msg) > 0;
+}
+
 int receive_message(int sockfd, Message *msg)
 {
-  int bytes_received = recv(sockfd, msg, sizeof(Message), 0);
-  if (bytes_received < 0)
+  int used;
+  while ((used = message_decode(recv_buffer, recv_length, msg)) == 0)
   {
-    perror("Receive failed");
-    return -1;
+    ssize_t bytes_received = recv(sockfd, recv_buffer + recv_length, sizeof(recv_buffer) - recv_length, 0);
+    if (bytes_received < 0)
+    {
+      perror("Receive failed");
+      return -1;
+    }
+    if (bytes_received == 0)
+    {
+      printf("Connection closed by server\n");
+      return -1;
+    }
+    recv_length += (size_t)bytes_received;
   }
-  if (bytes_received == 0)
+  if (used < 0)
   {
-    printf("Connection closed by server\n");
+    printf("Malformed frame from server\n");
     return -1;
   }
-  printf("Received message of type %d, content: %s, status: %d\n",
-         msg->message_type, msg->payload, msg->status);
+  recv_length -= (size_t)used;
+  memmove(recv_buffer, recv_buffer + used, recv_length);
+  if (message_is_binary(msg->message_type) && msg->status == SUCCESS)
+    printf("Received message of type %d, %d bytes, status: %d\n", msg->message_type, msg->length, msg->status);
+  else
+    printf("Received message of type %d, content: %s, status: %d\n",
+           msg->message_type, msg->payload, msg->status);
   return 0;
 }
 /********************************************************************************/
@@ -285,8 +332,10 @@ void init_game_state(int session_id)
   if (session_id != -1)
   {
     Message message;
+    SessionRequest request = {.session_id = session_id};
+    snprintf(request.player, sizeof(request.player), "%s", client_name);
     message.message_type = GAME_GET_TARGET;
-    sprintf(message.payload, "%d", session_id);
+    encode_session_request(&message, &request);
     queue_push(&send_queue, &message);
   }
 
@@ -311,9 +360,11 @@ void update_score_label()
 
 void handle_score_update(Message *msg)
 {
-  char player1_name[50], player2_name[50];
-  int player1_score, player2_score;
-  sscanf(msg->payload, "%49[^|]|%d|%49[^|]|%d", player1_name, &player1_score, player2_name, &player2_score);
+  ScoreUpdate update;
+  if (decode_score_update(msg, &update) < 0)
+    return;
+  const char *player1_name = update.player1, *player2_name = update.player2;
+  int player1_score = update.player1_score, player2_score = update.player2_score;
 
   // Update player 1 score label
   GtkLabel *player1_score_label = GTK_LABEL(gtk_builder_get_object(builder, "player1_score_label"));
@@ -346,7 +397,14 @@ void handle_game_start_response(Message *msg)
     if (p2_lbl)
       gtk_label_set_text(p2_lbl, "0");
 
-    sscanf(msg->payload, "%d|%d", &game_session_id, &player_num);
+    StartReply reply;
+    if (decode_start_reply(msg, &reply) < 0)
+    {
+      show_error_dialog("Failed to start game");
+      return;
+    }
+    game_session_id = reply.session_id;
+    player_num = reply.player_num;
     printf("Game session %d started. You are P%d\n", game_session_id, player_num);
     is_in_game = 1;
 
@@ -387,7 +445,8 @@ void handle_game_turn_response(Message *msg)
   if (msg->message_type == GAME_TURN)
   {
     int turn;
-    sscanf(msg->payload, "%d", &turn);
+    if (decode_turn(msg, &turn) < 0)
+      return;
 
     // Display turn notification
     g_print("It's turn of player %d\n", turn);
@@ -428,13 +487,6 @@ void handle_game_turn_response(Message *msg)
 
 void handle_game_guess_response(Message *msg)
 {
-  // Handle Timeout (Reported by server)
-  if (strncmp(msg->payload, "TIMEOUT_LOSE", 12) == 0)
-  {
-    // Display logic is already in handle_game_end
-    return;
-  }
-
   if (msg->status != SUCCESS)
   {
     show_error_dialog(msg->payload);
@@ -444,23 +496,29 @@ void handle_game_guess_response(Message *msg)
     return;
   }
 
+  GuessReply reply;
+  if (decode_guess_reply(msg, &reply) < 0)
+    return;
+
+  // Handle Timeout (Reported by server): display logic is already in handle_game_end
+  if (reply.outcome == GUESS_TIMEOUT_LOSE)
+    return;
+
   // Handle GAME CONTINUE
-  if (strncmp(msg->payload, "CONTINUE", 8) == 0)
+  if (reply.outcome == GUESS_CONTINUE && reply.word[0] != '\0')
   {
-    int next_player;
-    char last_word[20];
-    int s1, s2;
-    sscanf(msg->payload, "CONTINUE|%d|%s|%d|%d", &next_player, last_word, &s1, &s2);
-
-    // --- RESET TIMER (From 2nd turn onwards) ---
-    reset_timer();
+    int next_player = reply.next_player;
+    const char *last_word = reply.word;
 
     // Update UI
     if (next_player == player_num)
     {
+      // --- RESET TIMER (From 2nd turn onwards, only on my turn) ---
+      reset_timer();
+
       // My turn
       char msg_text[100];
-      char last_char = last_word[4];
+      char last_char = last_word[strlen(last_word) - 1];
 
       // "Đối thủ đánh: %s\nHãy nhập từ bắt đầu bằng: '%c'" -> English
       sprintf(msg_text, "Opponent played: %s\nEnter word starting with: '%c'", last_word, last_char);
@@ -476,6 +534,10 @@ void handle_game_guess_response(Message *msg)
       // Opponent's turn
       char msg_text[100];
 
+      // Chỉ người tới lượt đếm giờ, nếu không cả hai cùng gửi GAME_TIMEOUT
+      stop_timer();
+      gtk_label_set_text(timer_label, "Time: --");
+
       sprintf(msg_text, "You played: %s\nWaiting for opponent...", last_word);
       gtk_label_set_text(required_char_label, msg_text);
 
@@ -500,7 +562,7 @@ void handle_game_detail_response(Message *msg)
 
   int parsed_fields = sscanf(
       msg->payload,
-      "%19[^|]|%49[^|]|%49[^|]|%d|%d|%49[^|]|%5[^|]|%19[^|]|%19[^|]",
+      "%19[^|]|%49[^|]|%49[^|]|%d|%d|%49[^|]|%6[^|]|%19[^|]|%19[^|]",
       game_details.game_id, game_details.player1, game_details.player2,
       &game_details.player1_score, &game_details.player2_score,
       game_details.winner, game_details.word,
@@ -523,7 +585,7 @@ void handle_game_detail_response(Message *msg)
 
     while (line && move_index < 12)
     {
-      sscanf(line, "%49[^|]|%5[^|]|%5s",
+      sscanf(line, "%49[^|]|%6[^|]|%6s",
              game_details.moves[move_index].player_name,
              game_details.moves[move_index].guess,
              game_details.moves[move_index].result);
@@ -576,11 +638,11 @@ void handle_game_end(Message *msg)
 {
   if (msg->status == SUCCESS)
   {
-    char winner_name[50];
-    int score_change = 0;
-
-    if (sscanf(msg->payload, "%[^|]|%d", winner_name, &score_change) == 2)
+    EndNotice notice = {.reason = END_ABANDONED}; // Plain "Game Over" if it cannot be read
+    if (decode_end_notice(msg, &notice) == 0 && notice.reason == END_RESULT)
     {
+      const char *winner_name = notice.player;
+      int score_change = notice.score_change;
       char dialog_msg[200];
 
       if (strcmp(winner_name, client_name) == 0)
@@ -594,6 +656,10 @@ void handle_game_end(Message *msg)
         show_dialog(dialog_msg);
       }
     }
+    else if (notice.reason == END_SHUTDOWN)
+    {
+      show_dialog("Server is restarting.\nThe game was saved, no points changed.");
+    }
     else
     {
       show_dialog("Game Over!");
@@ -612,14 +678,15 @@ void handle_game_end(Message *msg)
 
 void handle_game_get_target_response(Message *msg)
 {
-  if (msg->status == SUCCESS)
+  char word[WIRE_WORD_SIZE];
+  if (msg->status == SUCCESS && decode_word(msg, word, sizeof(word)) == 0)
   {
-    // msg->payload chứa từ đã xáo trộn từ server
+    // Từ đã xáo trộn từ server
     if (hint_entry)
     {
-      gtk_entry_set_text(hint_entry, msg->payload);
+      gtk_entry_set_text(hint_entry, word);
     }
-    printf("Hint received: %s\n", msg->payload);
+    printf("Hint received: %s\n", word);
   }
   else
   {
@@ -627,6 +694,28 @@ void handle_game_get_target_response(Message *msg)
   }
 }
 
+// HintReply: từ gợi ý kèm score (số từ đối thủ còn có thể nối)
+void handle_game_hint_response(Message *msg)
+{
+  if (msg->status != SUCCESS)
+  {
+    show_error_dialog(msg->payload);
+    return;
+  }
+
+  HintReply reply;
+  if (decode_hint_reply(msg, &reply) < 0)
+    return;
+  char text[512] = "Best replies:";
+  for (int i = 0; i < reply.count; i++)
+  {
+    char line[80];
+    snprintf(line, sizeof(line), "\n%s (opponent has %d replies)", reply.words[i], reply.scores[i]);
+    strncat(text, line, sizeof(text) - strlen(text) - 1);
+  }
+  show_dialog(text);
+}
+
 void handle_get_score_by_user_response(Message *msg)
 {
   ScoreLabel = GTK_LABEL(gtk_builder_get_object(builder, "ScoreLabel"));
@@ -804,16 +893,20 @@ void handle_challange_response(Message *msg)
   {
     // Start the game if we're the challenger
     Message game_msg;
+    StartRequest request = {.word_length = 0};
     game_msg.message_type = GAME_START;
 
     if (strcmp(challenger, client_name) == 0)
     {
-      sprintf(game_msg.payload, "%s|%s", challenger, challenged);
+      snprintf(request.player1, sizeof(request.player1), "%s", challenger);
+      snprintf(request.player2, sizeof(request.player2), "%s", challenged);
     }
     else
     {
-      sprintf(game_msg.payload, "%s|%s", challenged, challenger);
+      snprintf(request.player1, sizeof(request.player1), "%s", challenged);
+      snprintf(request.player2, sizeof(request.player2), "%s", challenger);
     }
+    encode_start_request(&game_msg, &request);
 
     queue_push(&send_queue, &game_msg);
   }
@@ -1213,6 +1306,35 @@ int init_tcp_socket(const char *server_ip, int port)
   return sockfd;
 }
 
+// Unix socket connection (server started with --unix PATH)
+int init_unix_socket(const char *path)
+{
+  struct sockaddr_un server_addr;
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(server_addr.sun_path))
+  {
+    printf("Socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(server_addr.sun_path, path);
+
+  int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sockfd < 0)
+  {
+    perror("Socket creation failed");
+    return -1;
+  }
+  if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+  {
+    perror("Connection failed");
+    close(sockfd);
+    return -1;
+  }
+  printf("Connecting to server %s\n", path);
+  return sockfd;
+}
+
 // UI thread network response handler
 gboolean process_network_response(gpointer data)
 {
@@ -1270,6 +1392,15 @@ gboolean process_network_response(gpointer data)
       handle_get_score_by_user_response(&msg);
       break;
 
+    case GAME_HINT:
+      handle_game_hint_response(&msg);
+      break;
+
+    case SERVER_BUSY:
+      // Server refused the connection and closes it; payload says when to retry
+      show_error_dialog(msg.payload);
+      break;
+
     default:
       g_print("Unknown message type: %d\n", msg.message_type);
       break;
@@ -1281,8 +1412,9 @@ gboolean process_network_response(gpointer data)
 
 void *network_thread_func(void *arg)
 {
-  // Initialize the TCP socket
-  int sockfd = init_tcp_socket("127.0.0.1", 8080);
+  // Initialize the TCP socket, or the server's Unix socket if WORDCHAIN_SOCKET is set
+  const char *socket_path = getenv("WORDCHAIN_SOCKET");
+  int sockfd = socket_path != NULL ? init_unix_socket(socket_path) : init_tcp_socket("127.0.0.1", 8080);
   if (sockfd < 0)
   {
     return NULL;
@@ -1331,15 +1463,21 @@ void *network_thread_func(void *arg)
     if (FD_ISSET(sockfd, &read_fds))
     {
       Message recv_msg;
-      if (receive_message(sockfd, &recv_msg) == 0)
+      int rc;
+      // One read may carry several frames; select() will not report those again
+      do
       {
-        // Push the received message to the queue
-        queue_push(&receive_queue, &recv_msg);
+        rc = receive_message(sockfd, &recv_msg);
+        if (rc == 0)
+        {
+          // Push the received message to the queue
+          queue_push(&receive_queue, &recv_msg);
 
-        // Process the message in the UI thread
-        gdk_threads_add_idle(process_network_response, NULL);
-      }
-      else
+          // Process the message in the UI thread
+          gdk_threads_add_idle(process_network_response, NULL);
+        }
+      } while (rc == 0 && has_buffered_message());
+      if (rc != 0)
       {
         g_print("Failed to receive message\n");
         // Notify disconnection and exit
@@ -1715,8 +1853,10 @@ void on_BackToHome_in_game_clicked(GtkButton *button, gpointer user_data)
     {
       // Send a GAME_END message to the server
       Message message;
+      SessionRequest request = {.session_id = game_session_id};
+      snprintf(request.player, sizeof(request.player), "%s", client_name);
       message.message_type = GAME_END;
-      sprintf(message.payload, "%d|%s", game_session_id, client_name);
+      encode_session_request(&message, &request);
       queue_push(&send_queue, &message);
 
       // Update UI and navigate back to the homepage
@@ -1806,8 +1946,11 @@ void on_submit_word_clicked(GtkButton *button, gpointer user_data)
   }
 
   Message message;
+  GuessRequest request = {.session_id = game_session_id};
+  snprintf(request.player, sizeof(request.player), "%s", client_name);
+  snprintf(request.word, sizeof(request.word), "%s", word);
   message.message_type = GAME_GUESS;
-  sprintf(message.payload, "%d|%s|%s", game_session_id, client_name, word);
+  encode_guess_request(&message, &request);
 
   queue_push(&send_queue, &message);
 
@@ -1815,6 +1958,16 @@ void on_submit_word_clicked(GtkButton *button, gpointer user_data)
   gtk_widget_set_sensitive(GTK_WIDGET(submit_button), FALSE);
 }
 
+void on_hint_clicked(GtkButton *button, gpointer user_data)
+{
+  Message message;
+  HintRequest request = {.session_id = game_session_id, .count = 3};
+  snprintf(request.player, sizeof(request.player), "%s", client_name);
+  message.message_type = GAME_HINT;
+  encode_hint_request(&message, &request);
+  queue_push(&send_queue, &message);
+}
+
 void set_signal_connect();
 /********************************************************************************/
 
@@ -1898,16 +2051,19 @@ void init_game_board(GtkBuilder *builder)
   // NEW Submit Button
   // "Gửi" -> English
   submit_button = gtk_button_new_with_label("Submit");
+  hint_button = gtk_button_new_with_label("Hint");
 
   // Connect signals
   g_signal_connect(submit_button, "clicked", G_CALLBACK(on_submit_word_clicked), NULL);
   g_signal_connect(word_entry, "activate", G_CALLBACK(on_submit_word_clicked), NULL);
+  g_signal_connect(hint_button, "clicked", G_CALLBACK(on_hint_clicked), NULL);
 
   // Attach to Grid
   gtk_grid_attach(GTK_GRID(grid), GTK_WIDGET(timer_label), 0, 0, 1, 1);
   gtk_grid_attach(GTK_GRID(grid), GTK_WIDGET(required_char_label), 0, 1, 1, 1);
   gtk_grid_attach(GTK_GRID(grid), GTK_WIDGET(word_entry), 0, 2, 1, 1);
   gtk_grid_attach(GTK_GRID(grid), submit_button, 0, 3, 1, 1);
+  gtk_grid_attach(GTK_GRID(grid), hint_button, 0, 4, 1, 1);
 
   gtk_widget_show_all(grid);
 }
@@ -287,6 +287,50 @@ int update_user_offline(sqlite3 *db, const char *username) {
   return rc;
 }
 
+// Write-behind of presence: applies the changed isOnline values in one transaction.
+// With reset_all, everyone not listed is marked offline first (state left by an
+// earlier run is unknown). db must not be shared with other threads: a
+// transaction spans several calls and would take in their statements too.
+int save_users_online(sqlite3 *db, const PresenceChange *changes, int count, int reset_all) {
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(db, "UPDATE user SET isOnline = ? WHERE username = ?", -1, &stmt, 0);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  rc = sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    handle_db_error(db, sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    return rc;
+  }
+
+  if (reset_all)
+    rc = sqlite3_exec(db, "UPDATE user SET isOnline = 0 WHERE isOnline != 0;", NULL, NULL, NULL);
+  for (int i = 0; i < count && rc == SQLITE_OK; i++) {
+    sqlite3_bind_int(stmt, 1, changes[i].is_online);
+    sqlite3_bind_text(stmt, 2, changes[i].username, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+      fprintf(stderr, "Failed to update user status: %s\n", sqlite3_errmsg(db));
+      rc = SQLITE_ERROR;
+    }
+    sqlite3_reset(stmt);
+  }
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_OK) {
+    sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+    return rc;
+  }
+
+  rc = sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    handle_db_error(db, sqlite3_errmsg(db));
+    sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+  }
+  return rc;
+}
+
 int list_users_online(sqlite3 *db, User *users, int *user_count) {
   const char *sql = "SELECT id, username, score, isOnline FROM user WHERE isOnline = 1";
   sqlite3_stmt *stmt;
@@ -452,6 +496,30 @@ int save_game_history(sqlite3 *db, GameHistory *game) {
   return SQLITE_OK;
 }
 
+// Save several game histories in one transaction: all of them or none
+int save_game_histories(sqlite3 *db, GameHistory *games, int count) {
+  int rc = sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    handle_db_error(db, sqlite3_errmsg(db));
+    return rc;
+  }
+
+  for (int i = 0; i < count; i++) {
+    rc = save_game_history(db, &games[i]);
+    if (rc != SQLITE_OK) {
+      sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+      return rc;
+    }
+  }
+
+  rc = sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    handle_db_error(db, sqlite3_errmsg(db));
+    sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+  }
+  return rc;
+}
+
 // Function to get game history by player name
 int get_game_history_by_player(sqlite3 *db, const char *player_name, GameHistory *response) {
   const char *sql_select =
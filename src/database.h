@@ -6,14 +6,19 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 
 #define USER_TABLE "user"
 #define MAX_USERNAME_LEN 50
 #define MAX_PASSWORD_LEN 50
 #define MAX_ATTEMPTS 12
-#define WORD_LENGTH 5
+#define WORD_LENGTH 5     // Độ dài mặc định
+#define MIN_WORD_LENGTH 4 // Độ dài hỗ trợ (word_engine.c)
+#define MAX_WORD_LENGTH 6
 #define MAX_WORDS 15000
+#define MAX_TURNS (MAX_ATTEMPTS * 2)
+#define USED_WORDS_SIZE ((MAX_WORDS + 63) / 64) // Bitset theo chỉ số từ điển
 
 typedef struct
 {
@@ -27,18 +32,35 @@ typedef struct
 typedef struct
 {
   char player_name[50];
-  char guess[WORD_LENGTH + 1];
-  char result[WORD_LENGTH + 1];
+  char guess[MAX_WORD_LENGTH + 1];
+  char result[MAX_WORD_LENGTH + 1];
 } PlayTurn;
 
+// Một nước trong session; tên người chơi chỉ dựng lại khi ghi lịch sử
+typedef struct
+{
+  uint8_t player; // 1 or 2
+  char guess[MAX_WORD_LENGTH + 1];
+} SessionTurn;
+
+struct Dictionary;
+
 typedef struct
 {
   char game_id[20];
-  char player1_name[50];
-  char player2_name[50];
+  uint32_t player1_id; // Id trong registry (registry.h), session giữ một tham chiếu
+  uint32_t player2_id;
+  // Kết nối của hai người chơi, chép từ registry khi tạo ván để nước đi không
+  // phải lấy players_lock; -1 khi người chơi đã rời kết nối đó
+  int player1_sock;
+  int player2_sock;
+  unsigned player1_generation; // event_loop_generation của kết nối, fd có thể bị dùng lại
+  unsigned player2_generation;
 
-  char last_word[WORD_LENGTH + 1]; // Lưu từ vừa đánh xong
-  time_t last_move_time;           // Lưu thời điểm bắt đầu lượt hiện tại
+  int word_length;                     // Độ dài từ của ván (MIN_WORD_LENGTH..MAX_WORD_LENGTH)
+  char last_word[MAX_WORD_LENGTH + 1]; // Lưu từ vừa đánh xong
+  uint32_t last_key;                   // last_word dạng packed (dict_pack)
+  time_t last_move_time;               // Lưu thời điểm bắt đầu lượt hiện tại
 
   int current_player; // 1 or 2
   int player1_score;
@@ -47,7 +69,10 @@ typedef struct
   int current_attempts;
   char start_time[20];
   char end_time[20];
-  PlayTurn turns[MAX_ATTEMPTS * 2]; // Tăng số lượng lưu trữ vì game nối từ có thể dài
+  SessionTurn turns[MAX_TURNS]; // Tăng số lượng lưu trữ vì game nối từ có thể dài
+  struct Dictionary *dictionary;         // Thế hệ từ điển session dùng tới khi kết thúc
+  uint64_t used_words[USED_WORDS_SIZE]; // Bit i = từ thứ i trong từ điển đã dùng
+  uint16_t remaining_by_letter[26];     // Số từ chưa dùng theo chữ cái đầu
 } GameSession;
 
 typedef struct
@@ -58,16 +83,24 @@ typedef struct
   int player1_score;
   int player2_score;
   char winner[51];
-  char word[WORD_LENGTH + 1];
+  char word[MAX_WORD_LENGTH + 1];
   PlayTurn moves[12];
   char start_time[20];
   char end_time[20];
 } GameHistory;
 
+// Một dòng isOnline cần ghi (save_users_online)
 typedef struct
 {
-  char player_name[50];
+  char username[MAX_USERNAME_LEN];
+  int is_online;
+} PresenceChange;
+
+typedef struct
+{
+  uint32_t player_id; // Tên: registry_name(player_id)
   int player_sock;
+  int session_id; // Session đang chơi, -1 nếu không có
 } PlayerInfo;
 
 int init_db(sqlite3 **db, const char *db_name);
@@ -82,9 +115,11 @@ int authenticate_user(sqlite3 *db, const char *username, const char *password);
 int update_user_online(sqlite3 *db, const char *username);
 int update_user_offline(sqlite3 *db, const char *username);
 int update_user_score(sqlite3 *db, const char *username, int score);
+int save_users_online(sqlite3 *db, const PresenceChange *changes, int count, int reset_all);
 int list_users_online(sqlite3 *db, User *users, int *user_count);
 int list_users_closest_score(sqlite3 *db, const char *target_username, User *users, int *user_count);
 int save_game_history(sqlite3 *db, GameHistory *game);
+int save_game_histories(sqlite3 *db, GameHistory *games, int count);
 int get_game_history_by_player(sqlite3 *db, const char *player_name, GameHistory *response);
 int get_game_histories_by_player(sqlite3 *db, const char *player_name, GameHistory *history_list, int *history_count);
 int get_game_history_by_id(sqlite3 *db, const char *game_id, GameHistory *game_details);
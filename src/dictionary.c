@@ -0,0 +1,477 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "dictionary.h"
+#include "word_kernels.h"
+
+static uint32_t hash_key(uint32_t key)
+{
+  key ^= key >> 15;
+  key *= 0x2C1B3C6Du;
+  key ^= key >> 12;
+  return key;
+}
+
+// Returns the slot holding key, or the empty slot where it would be inserted
+static uint32_t find_slot(const Dictionary *dict, uint32_t key)
+{
+  uint32_t slot = hash_key(key) & dict->slot_mask;
+  while (dict->slots[slot] != 0 && dict->keys[dict->slots[slot] - 1] != key)
+  {
+    slot = (slot + 1) & dict->slot_mask;
+  }
+  return slot;
+}
+
+// FNV-1a over the whole index image, with the header checksum taken as 0
+static uint32_t index_checksum(const char *storage, size_t size)
+{
+  WordIndexHeader header;
+  memcpy(&header, storage, sizeof(header));
+  header.checksum = 0;
+
+  uint32_t hash = 2166136261u;
+  const unsigned char *bytes = (const unsigned char *)&header;
+  for (size_t i = 0; i < sizeof(header); i++)
+  {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  bytes = (const unsigned char *)storage;
+  for (size_t i = sizeof(header); i < size; i++)
+  {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// Point dict at an index image (heap block or mapped file) laid out as
+// WordIndexHeader, keys, slots.
+static void attach_storage(Dictionary *dict, void *storage, size_t size, int mapped)
+{
+  const WordIndexHeader *header = storage;
+  dict->keys = (const uint32_t *)((const char *)storage + sizeof(WordIndexHeader));
+  dict->slots = dict->keys + header->word_count;
+  dict->pair_offsets = header->pair_offsets;
+  dict->engine = word_engine_for((int)header->word_length);
+  dict->slot_mask = header->slot_count - 1;
+  dict->count = (int)header->word_count;
+  dict->storage = storage;
+  dict->storage_size = size;
+  dict->mapped = mapped;
+}
+
+static int letter_pair(const WordEngine *engine, uint32_t key)
+{
+  return engine->first(key) * ALPHABET_SIZE + word_key_last(key);
+}
+
+static int compare_sort_keys(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Sort by (first letter, last letter), then alphabetically. The pair goes in
+// the high half of a 64-bit sort key so qsort needs no engine context.
+static void sort_keys(const WordEngine *engine, uint32_t *keys, uint64_t *scratch, int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    scratch[i] = ((uint64_t)letter_pair(engine, keys[i]) << 32) | keys[i];
+  }
+  qsort(scratch, count, sizeof(uint64_t), compare_sort_keys);
+  for (int i = 0; i < count; i++)
+  {
+    keys[i] = (uint32_t)scratch[i];
+  }
+}
+
+// Sort and deduplicate keys, then lay out the index image in one block
+static int build_index(Dictionary *dict, const WordEngine *engine, uint32_t *keys, int count)
+{
+  uint64_t *scratch = malloc(sizeof(uint64_t) * (count > 0 ? count : 1));
+  if (scratch == NULL)
+    return -1;
+  sort_keys(engine, keys, scratch, count);
+  free(scratch);
+
+  int unique = 0;
+  for (int i = 0; i < count; i++)
+  {
+    if (unique == 0 || keys[unique - 1] != keys[i])
+      keys[unique++] = keys[i];
+  }
+
+  // Keep the load factor at or below 50% so probes stay short
+  uint32_t slot_count = 1;
+  while (slot_count < (uint32_t)unique * 2)
+  {
+    slot_count <<= 1;
+  }
+
+  size_t size = sizeof(WordIndexHeader) + sizeof(uint32_t) * (unique + slot_count);
+  char *storage = calloc(1, size);
+  if (storage == NULL)
+    return -1;
+
+  WordIndexHeader *header = (WordIndexHeader *)storage;
+  uint32_t *index_keys = (uint32_t *)(storage + sizeof(WordIndexHeader));
+  uint32_t *slots = index_keys + unique;
+  header->magic = WORD_INDEX_MAGIC;
+  header->version = WORD_INDEX_VERSION;
+  header->word_length = (uint32_t)engine->length;
+  header->word_count = unique;
+  header->slot_count = slot_count;
+  memcpy(index_keys, keys, sizeof(uint32_t) * unique);
+
+  // Count the 26x26 first/last transitions, then prefix-sum them into offsets
+  for (int i = 0; i < unique; i++)
+  {
+    header->pair_offsets[letter_pair(engine, index_keys[i]) + 1]++;
+  }
+  for (int p = 0; p < LETTER_PAIRS; p++)
+  {
+    header->pair_offsets[p + 1] += header->pair_offsets[p];
+  }
+
+  attach_storage(dict, storage, size, 0);
+  for (int i = 0; i < unique; i++)
+  {
+    slots[find_slot(dict, index_keys[i])] = (uint32_t)i + 1;
+  }
+  header->checksum = index_checksum(storage, size);
+  return unique;
+}
+
+// Parse a text word list (one word per line). Words that are not exactly
+// length lowercase letters are skipped, as are duplicates.
+int dict_load_text(Dictionary *dict, const char *filename, int length)
+{
+  memset(dict, 0, sizeof(Dictionary));
+  const WordEngine *engine = word_engine_for(length);
+  if (engine == NULL)
+  {
+    fprintf(stderr, "Unsupported word length %d\n", length);
+    return -1;
+  }
+  FILE *file = fopen(filename, "r");
+  if (file == NULL)
+  {
+    perror("Error opening file");
+    return -1;
+  }
+
+  uint32_t *keys = malloc(sizeof(uint32_t) * MAX_WORDS);
+  if (keys == NULL)
+  {
+    fclose(file);
+    return -1;
+  }
+
+  char word[64];
+  int count = 0, skipped = 0;
+  while (count < MAX_WORDS && fscanf(file, "%63s", word) == 1)
+  {
+    uint32_t key = engine->pack(word);
+    if (key == 0)
+      skipped++;
+    else
+      keys[count++] = key;
+  }
+  fclose(file);
+
+  if (skipped > 0)
+    fprintf(stderr, "Skipped %d invalid words in %s\n", skipped, filename);
+
+  int rc = build_index(dict, engine, keys, count);
+  free(keys);
+  return rc;
+}
+
+// Map a compiled index read-only. The file is checked against its header and
+// checksum instead of being parsed; any mismatch returns -1.
+int dict_load_binary(Dictionary *dict, const char *filename, int length)
+{
+  memset(dict, 0, sizeof(Dictionary));
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(WordIndexHeader))
+  {
+    close(fd);
+    return -1;
+  }
+
+  size_t size = (size_t)st.st_size;
+  void *storage = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (storage == MAP_FAILED)
+    return -1;
+
+  const WordIndexHeader *header = storage;
+  const char *error = NULL;
+  if (header->magic != WORD_INDEX_MAGIC)
+    error = "bad magic";
+  else if (header->version != WORD_INDEX_VERSION)
+    error = "unsupported version";
+  else if (header->word_length != (uint32_t)length || word_engine_for(length) == NULL)
+    error = "word length mismatch";
+  else if (header->slot_count == 0 || (header->slot_count & (header->slot_count - 1)) != 0 ||
+           header->word_count > MAX_WORDS || header->slot_count <= header->word_count ||
+           header->pair_offsets[LETTER_PAIRS] != header->word_count ||
+           size != sizeof(WordIndexHeader) + sizeof(uint32_t) * ((size_t)header->word_count + header->slot_count))
+    error = "corrupt layout";
+  else if (index_checksum(storage, size) != header->checksum)
+    error = "checksum mismatch";
+
+  if (error != NULL)
+  {
+    fprintf(stderr, "Ignoring %s: %s\n", filename, error);
+    munmap(storage, size);
+    return -1;
+  }
+
+  attach_storage(dict, storage, size, 1);
+  return dict->count;
+}
+
+// Write the index image to filename. A temporary file is renamed into place
+// so a running server never maps a half-written index.
+int dict_write_binary(const Dictionary *dict, const char *filename)
+{
+  char tmp_name[512];
+  snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", filename);
+
+  FILE *file = fopen(tmp_name, "wb");
+  if (file == NULL)
+  {
+    perror("Error opening output file");
+    return -1;
+  }
+  size_t written = fwrite(dict->storage, 1, dict->storage_size, file);
+  if (fclose(file) != 0 || written != dict->storage_size)
+  {
+    perror("Error writing output file");
+    remove(tmp_name);
+    return -1;
+  }
+  if (rename(tmp_name, filename) != 0)
+  {
+    perror("Error renaming output file");
+    remove(tmp_name);
+    return -1;
+  }
+  return 0;
+}
+
+void dict_free(Dictionary *dict)
+{
+  if (dict->mapped)
+    munmap(dict->storage, dict->storage_size);
+  else
+    free(dict->storage);
+  memset(dict, 0, sizeof(Dictionary));
+}
+
+// Load a heap-allocated dictionary generation of length-letter words holding
+// one reference. The compiled index is preferred; the text list is the fallback.
+Dictionary *dict_create(const char *index_file, const char *text_file, int length)
+{
+  Dictionary *dict = malloc(sizeof(Dictionary));
+  if (dict == NULL)
+    return NULL;
+
+  int count = dict_load_binary(dict, index_file, length);
+  if (count > 0)
+  {
+    printf("Mapped %d words from %s\n", count, index_file);
+  }
+  else
+  {
+    count = dict_load_text(dict, text_file, length);
+    printf("Loaded %d words from %s\n", count, text_file);
+  }
+
+  if (count <= 0)
+  {
+    dict_free(dict);
+    free(dict);
+    return NULL;
+  }
+  atomic_init(&dict->refs, 1);
+  return dict;
+}
+
+Dictionary *dict_acquire(Dictionary *dict)
+{
+  if (dict != NULL)
+    atomic_fetch_add(&dict->refs, 1);
+  return dict;
+}
+
+// Drop one reference; the last holder unmaps/frees the generation
+void dict_release(Dictionary *dict)
+{
+  if (dict == NULL || atomic_fetch_sub(&dict->refs, 1) != 1)
+    return;
+  printf("Retired dictionary generation %d\n", dict->generation);
+  dict_free(dict);
+  free(dict);
+}
+
+// Constant time lookup. Returns the dictionary index of key, or -1.
+int dict_index_of_key(const Dictionary *dict, uint32_t key)
+{
+  if (key == 0 || dict->slots == NULL)
+    return -1;
+  uint32_t slot = find_slot(dict, key);
+  return (int)dict->slots[slot] - 1;
+}
+
+int dict_index_of(const Dictionary *dict, const char *word)
+{
+  return dict_index_of_key(dict, dict->engine->pack(word));
+}
+
+int dict_contains(const Dictionary *dict, const char *word)
+{
+  return dict_index_of(dict, word) != -1;
+}
+
+// Reference implementation: scans every key. Only meant for checking
+// dict_contains against, never for the request path.
+int dict_contains_linear(const Dictionary *dict, const char *word)
+{
+  uint32_t key = dict->engine->pack(word);
+  if (key == 0)
+    return 0;
+  return word_find(dict->keys, dict->count, key) != -1;
+}
+
+#define SUGGEST_BLOCK 256
+
+static long elapsed_ns(const struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000000L + (now.tv_nsec - start->tv_nsec);
+}
+
+// Find up to k unused words closest to key by Hamming distance (at most
+// max_distance letters apart), restricted to words starting with first_letter
+// when it is >= 0. The scan checks the clock after every block and returns
+// what it has once budget_ns is spent. Results are ordered by distance.
+int dict_suggest(const Dictionary *dict, uint32_t key, int first_letter, const uint64_t *used,
+                 int max_distance, long budget_ns, uint32_t *out, int k)
+{
+  int begin = 0, end = dict->count;
+  if (first_letter >= 0)
+    dict_letter_bucket(dict, first_letter, &begin, &end);
+  if (k > MAX_SUGGESTIONS)
+    k = MAX_SUGGESTIONS;
+  if (k <= 0)
+    return 0;
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  uint8_t distances[SUGGEST_BLOCK];
+  int best_distance[MAX_SUGGESTIONS];
+  int found = 0;
+  for (int block = begin; block < end; block += SUGGEST_BLOCK)
+  {
+    int n = end - block < SUGGEST_BLOCK ? end - block : SUGGEST_BLOCK;
+    dict->engine->distances(dict->keys + block, n, key, distances);
+
+    for (int i = 0; i < n; i++)
+    {
+      int d = distances[i];
+      if (d == 0 || d > max_distance || (found == k && d >= best_distance[k - 1]))
+        continue;
+      if (used != NULL && word_set_test(used, block + i))
+        continue;
+
+      // Insert into the sorted top-k, keeping earlier words first on ties
+      int pos = found < k ? found++ : k - 1;
+      while (pos > 0 && best_distance[pos - 1] > d)
+      {
+        best_distance[pos] = best_distance[pos - 1];
+        out[pos] = out[pos - 1];
+        pos--;
+      }
+      best_distance[pos] = d;
+      out[pos] = dict->keys[block + i];
+    }
+
+    if ((found == k && best_distance[k - 1] == 1) || elapsed_ns(&start) > budget_ns)
+      break;
+  }
+  return found;
+}
+
+static int compare_ints(const void *a, const void *b)
+{
+  int x = *(const int *)a, y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+// Rank legal replies (unused words starting with first_letter, or any letter
+// when it is < 0) by how many unused words the opponent could answer with:
+// remaining_by_letter of the reply's last letter, less the reply itself when it
+// starts with that letter too. Whole (first, last) pair buckets share a score,
+// so only the 26 (or 676) pairs are sorted and words are read in that order.
+// Fills out/scores with up to k replies, best (lowest score) first.
+int dict_rank_replies(const Dictionary *dict, int first_letter, const uint64_t *used,
+                      const uint16_t *remaining_by_letter, uint32_t *out, int *scores, int k)
+{
+  int ranked[LETTER_PAIRS]; // score * LETTER_PAIRS + pair, so sorting orders by score
+  int n = 0;
+  int from = first_letter >= 0 ? first_letter : 0;
+  int to = first_letter >= 0 ? first_letter : ALPHABET_SIZE - 1;
+  for (int f = from; f <= to; f++)
+  {
+    for (int l = 0; l < ALPHABET_SIZE; l++)
+    {
+      if (dict_transition_count(dict, f, l) == 0)
+        continue;
+      int score = remaining_by_letter[l] - (f == l ? 1 : 0);
+      ranked[n++] = (score < 0 ? 0 : score) * LETTER_PAIRS + f * ALPHABET_SIZE + l;
+    }
+  }
+  qsort(ranked, n, sizeof(int), compare_ints);
+
+  int found = 0;
+  for (int r = 0; r < n && found < k; r++)
+  {
+    int pair = ranked[r] % LETTER_PAIRS;
+    int begin = (int)dict->pair_offsets[pair], end = (int)dict->pair_offsets[pair + 1];
+    for (int i = begin; i < end && found < k; i++)
+    {
+      if (used != NULL && word_set_test(used, i))
+        continue;
+      out[found] = dict->keys[i];
+      scores[found] = ranked[r] / LETTER_PAIRS;
+      found++;
+    }
+  }
+  return found;
+}
+
+int dict_letter_bucket(const Dictionary *dict, int first, int *begin, int *end)
+{
+  *begin = (int)dict->pair_offsets[first * ALPHABET_SIZE];
+  *end = (int)dict->pair_offsets[(first + 1) * ALPHABET_SIZE];
+  return *end - *begin;
+}
+
+int dict_pair_bucket(const Dictionary *dict, int first, int last, int *begin, int *end)
+{
+  int pair = first * ALPHABET_SIZE + last;
+  *begin = (int)dict->pair_offsets[pair];
+  *end = (int)dict->pair_offsets[pair + 1];
+  return *end - *begin;
+}
@@ -0,0 +1,119 @@
+#ifndef DICTIONARY_H
+#define DICTIONARY_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "database.h"
+#include "word_engine.h"
+
+#define ALPHABET_SIZE 26
+#define LETTER_PAIRS (ALPHABET_SIZE * ALPHABET_SIZE)
+#define MAX_SUGGESTIONS 8
+
+// Compiled word index written by wordc and mapped by the server
+#define WORD_INDEX_MAGIC 0x58444E49u // "INDX"
+#define WORD_INDEX_VERSION 2
+
+// On-disk layout: header, keys[word_count], slots[slot_count]
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t word_length;
+  uint32_t word_count;
+  uint32_t slot_count;
+  uint32_t checksum; // FNV-1a over the whole file, computed with this field = 0
+  // Keys are grouped by (first letter, last letter); the words starting with
+  // f and ending with l are keys[pair_offsets[f * 26 + l] .. pair_offsets[f * 26 + l + 1])
+  uint32_t pair_offsets[LETTER_PAIRS + 1];
+} WordIndexHeader;
+
+typedef struct Dictionary
+{
+  const uint32_t *keys;         // Packed words grouped by first/last letter, one per dictionary index
+  const uint32_t *slots;        // Open addressing table: dictionary index + 1, 0 = empty slot
+  const uint32_t *pair_offsets; // See WordIndexHeader
+  const WordEngine *engine;     // Kernels for this dictionary's word length
+  uint32_t slot_mask;           // Table size - 1 (table size is a power of two)
+  int count;
+  void *storage; // Heap block or mapped file holding header, keys and slots
+  size_t storage_size;
+  int mapped;
+  atomic_int refs; // Holders of this generation (server + sessions), see dict_release()
+  int generation;
+} Dictionary;
+
+int dict_load_text(Dictionary *dict, const char *filename, int length);
+int dict_load_binary(Dictionary *dict, const char *filename, int length);
+int dict_write_binary(const Dictionary *dict, const char *filename);
+void dict_free(Dictionary *dict);
+Dictionary *dict_create(const char *index_file, const char *text_file, int length);
+Dictionary *dict_acquire(Dictionary *dict);
+void dict_release(Dictionary *dict);
+int dict_index_of_key(const Dictionary *dict, uint32_t key);
+int dict_index_of(const Dictionary *dict, const char *word);
+int dict_contains(const Dictionary *dict, const char *word);
+int dict_contains_linear(const Dictionary *dict, const char *word);
+
+static inline int dict_word_length(const Dictionary *dict)
+{
+  return dict->engine->length;
+}
+
+// Pack a word of this dictionary's length into a key; 0 if it is not one
+static inline uint32_t dict_pack(const Dictionary *dict, const char *word)
+{
+  return dict->engine->pack(word);
+}
+
+static inline void dict_unpack(const Dictionary *dict, uint32_t key, char *word)
+{
+  dict->engine->unpack(key, word);
+}
+
+// Letter index (0-25) of the first letter of a packed word
+static inline int dict_key_first(const Dictionary *dict, uint32_t key)
+{
+  return dict->engine->first(key);
+}
+
+// Bitset over dictionary indexes (see GameSession.used_words)
+static inline int word_set_test(const uint64_t *set, int index)
+{
+  return (int)((set[index >> 6] >> (index & 63)) & 1);
+}
+
+static inline void word_set_add(uint64_t *set, int index)
+{
+  set[index >> 6] |= (uint64_t)1 << (index & 63);
+}
+
+int dict_suggest(const Dictionary *dict, uint32_t key, int first_letter, const uint64_t *used,
+                 int max_distance, long budget_ns, uint32_t *out, int k);
+int dict_rank_replies(const Dictionary *dict, int first_letter, const uint64_t *used,
+                      const uint16_t *remaining_by_letter, uint32_t *out, int *scores, int k);
+
+// First/last letter index. Letters are 0-25; ranges are [*begin, *end) over dict->keys.
+int dict_letter_bucket(const Dictionary *dict, int first, int *begin, int *end);
+int dict_pair_bucket(const Dictionary *dict, int first, int last, int *begin, int *end);
+
+// Number of words starting with letter
+static inline int dict_count_starting_with(const Dictionary *dict, int letter)
+{
+  return (int)(dict->pair_offsets[(letter + 1) * ALPHABET_SIZE] - dict->pair_offsets[letter * ALPHABET_SIZE]);
+}
+
+// Number of words starting with first and ending with last (26x26 transition matrix)
+static inline int dict_transition_count(const Dictionary *dict, int first, int last)
+{
+  int pair = first * ALPHABET_SIZE + last;
+  return (int)(dict->pair_offsets[pair + 1] - dict->pair_offsets[pair]);
+}
+
+// Number of dictionary words that may legally follow key
+static inline int dict_reply_count(const Dictionary *dict, uint32_t key)
+{
+  return dict_count_starting_with(dict, word_key_last(key));
+}
+
+#endif
@@ -0,0 +1,982 @@
+#define _GNU_SOURCE // accept4
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include "event_loop_internal.h"
+#include "admission.h"
+
+#define MAX_EVENTS 256    // Events taken per epoll_wait
+#define RECV_CHUNK 16384  // Bytes read per recv(), several Messages at once
+
+__thread EventLoop *current_loop = NULL;
+
+// Connections indexed by fd. A slot is only touched by the loop that owns the
+// fd; fd_owners and fd_generations may be read from any loop to find where to
+// send, and to whom.
+static Connection **connections = NULL;
+static EventLoop *_Atomic *fd_owners = NULL;
+static atomic_uint *fd_generations = NULL; // 0: no client
+static atomic_uint last_generation;
+static int connection_capacity = 0;
+
+// The client a mailbox handler is running for (event_loop_post_client)
+static __thread int mail_fd = -1;
+static __thread unsigned mail_generation;
+
+/*****************************CONNECTIONS*************************************/
+
+int event_loop_init(int max_fds)
+{
+  connections = calloc(max_fds, sizeof(Connection *));
+  fd_owners = calloc(max_fds, sizeof(*fd_owners));
+  fd_generations = calloc(max_fds, sizeof(*fd_generations));
+  if (connections == NULL || fd_owners == NULL || fd_generations == NULL)
+  {
+    free(connections);
+    free((void *)fd_owners);
+    free((void *)fd_generations);
+    return -1;
+  }
+  connection_capacity = max_fds;
+  return 0;
+}
+
+static Connection *connection_create(int fd, EventLoop *owner)
+{
+  Connection *conn = fd >= 0 && fd < connection_capacity ? calloc(1, sizeof(Connection)) : NULL;
+  if (conn == NULL)
+    return NULL;
+  conn->fd = fd;
+  do
+    conn->generation = atomic_fetch_add(&last_generation, 1) + 1;
+  while (conn->generation == 0); // 0 stays "no client" after wrapping
+  connections[fd] = conn;
+  atomic_store(&fd_generations[fd], conn->generation);
+  atomic_store(&fd_owners[fd], owner);
+  return conn;
+}
+
+// Drop fd from the tables; mail still on its way to it is then discarded
+static void connection_forget(int fd)
+{
+  connections[fd] = NULL;
+  atomic_store(&fd_owners[fd], NULL);
+  atomic_store(&fd_generations[fd], 0);
+}
+
+unsigned event_loop_generation(int fd)
+{
+  if (fd >= 0 && fd == mail_fd)
+    return mail_generation;
+  if (fd < 0 || fd >= connection_capacity)
+    return 0;
+  return atomic_load(&fd_generations[fd]);
+}
+
+// Best effort: the socket is new, so one small frame fits in its buffer
+static void refuse_connection(int fd)
+{
+  Message message;
+  char frame[MESSAGE_MAX_FRAME];
+  message.message_type = SERVER_BUSY;
+  admission_refuse(&message, ADMIT_CONNECTION);
+  size_t len = message_encode(&message, frame);
+  send(fd, frame, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+// Returns NULL if the client cannot be admitted; the caller closes fd
+Connection *connection_open(int fd)
+{
+  if (!admission_acquire(ADMIT_CONNECTION))
+  {
+    refuse_connection(fd);
+    return NULL;
+  }
+  Connection *conn = connection_create(fd, current_loop);
+  if (conn == NULL)
+  {
+    printf("Cannot track connection %d, closing\n", fd);
+    admission_release(ADMIT_CONNECTION);
+    return NULL;
+  }
+  return conn;
+}
+
+// Only for fds owned by the calling loop
+Connection *connection_get(int fd)
+{
+  if (fd < 0 || fd >= connection_capacity || atomic_load(&fd_owners[fd]) != current_loop)
+    return NULL;
+  return connections[fd];
+}
+
+// Hand every whole frame in data to on_message, keeping a partial one in
+// in_buf. Returns -1 on a malformed frame; the caller drops the client.
+int connection_feed(Connection *conn, const char *data, size_t len)
+{
+  Message message;
+  while (len > 0)
+  {
+    int used;
+    if (conn->in_len == 0)
+    {
+      // Common case: decode straight from the receive buffer
+      used = message_decode(data, len, &message);
+      if (used == 0)
+      {
+        memcpy(conn->in_buf, data, len); // A partial frame is never larger than in_buf
+        conn->in_len = len;
+        return 0;
+      }
+      if (used < 0)
+        return -1;
+      data += used;
+      len -= used;
+    }
+    else
+    {
+      size_t old_len = conn->in_len;
+      size_t n = sizeof(conn->in_buf) - old_len;
+      if (n > len)
+        n = len;
+      memcpy(conn->in_buf + old_len, data, n);
+      used = message_decode(conn->in_buf, old_len + n, &message);
+      if (used == 0)
+      {
+        conn->in_len = old_len + n;
+        return 0;
+      }
+      if (used < 0)
+      {
+        conn->in_len = 0;
+        return -1;
+      }
+      // Only the bytes past what in_buf already held come out of data
+      conn->in_len = 0;
+      data += (size_t)used - old_len;
+      len -= (size_t)used - old_len;
+    }
+    current_loop->on_message(conn->fd, &message);
+  }
+  return 0;
+}
+
+static Frame *frame_create(const Message *message)
+{
+  char data[MESSAGE_MAX_FRAME];
+  size_t len = message_encode(message, data);
+  Frame *frame = malloc(sizeof(Frame) + len);
+  if (frame == NULL)
+    return NULL;
+  atomic_init(&frame->refs, 1);
+  frame->len = len;
+  memcpy(frame->data, data, len);
+  return frame;
+}
+
+static void frame_release(Frame *frame)
+{
+  if (atomic_fetch_sub(&frame->refs, 1) == 1)
+    free(frame);
+}
+
+// Queue frame for conn, taking a reference. Returns 1 if the queue was empty
+// (the caller starts sending), 0 if it waits behind others, -1 if dropped.
+int connection_queue(Connection *conn, Frame *frame)
+{
+  if (conn->aborted)
+    return -1;
+  if (conn->out_bytes + frame->len > OUTBOX_LIMIT)
+  {
+    connection_abort(conn, "outbound queue full");
+    return -1;
+  }
+  OutboxEntry *entry = malloc(sizeof(OutboxEntry));
+  if (entry == NULL)
+    return -1;
+  atomic_fetch_add(&frame->refs, 1);
+  entry->next = NULL;
+  entry->frame = frame;
+
+  int was_empty = conn->send_head == NULL;
+  if (was_empty)
+    conn->send_head = entry;
+  else
+    conn->send_tail->next = entry;
+  conn->send_tail = entry;
+  conn->out_bytes += frame->len;
+  if (conn->out_bytes > OUTBOX_HIGH_WATERMARK)
+    conn->paused = 1;
+  return was_empty;
+}
+
+// Point iov at up to max queued frames, from the first unsent byte
+int connection_fill_iov(Connection *conn, struct iovec *iov, int max)
+{
+  int count = 0;
+  size_t skip = conn->head_sent;
+  for (OutboxEntry *entry = conn->send_head; entry != NULL && count < max; entry = entry->next)
+  {
+    iov[count].iov_base = entry->frame->data + skip;
+    iov[count].iov_len = entry->frame->len - skip;
+    skip = 0;
+    count++;
+  }
+  return count;
+}
+
+// sent bytes went out: drop the frames they completed
+void connection_consume(Connection *conn, size_t sent)
+{
+  conn->out_bytes -= sent;
+  sent += conn->head_sent;
+  while (conn->send_head != NULL && sent >= conn->send_head->frame->len)
+  {
+    OutboxEntry *entry = conn->send_head;
+    sent -= entry->frame->len;
+    conn->send_head = entry->next;
+    frame_release(entry->frame);
+    free(entry);
+  }
+  if (conn->send_head == NULL)
+    conn->send_tail = NULL;
+  conn->head_sent = sent;
+}
+
+void connection_free_sends(Connection *conn)
+{
+  while (conn->send_head != NULL)
+  {
+    OutboxEntry *next = conn->send_head->next;
+    frame_release(conn->send_head->frame);
+    free(conn->send_head);
+    conn->send_head = next;
+  }
+  conn->send_tail = NULL;
+  conn->head_sent = 0;
+  conn->out_bytes = 0;
+}
+
+// Give up on a client. Closing here could pull the Connection out from under
+// a handler, so it is only shut down; reading resumes, finds the hangup and
+// closes it the usual way.
+void connection_abort(Connection *conn, const char *reason)
+{
+  if (conn->aborted)
+    return;
+  printf("Dropping client %d: %s\n", conn->fd, reason);
+  conn->aborted = 1;
+  conn->paused = 0;
+  shutdown(conn->fd, SHUT_RDWR);
+}
+
+// Tell the server the client is gone and drop it from the table. The backend
+// closes the fd right after; nothing else closes client fds.
+void connection_detach(Connection *conn)
+{
+  current_loop->on_disconnect(conn->fd);
+  connection_forget(conn->fd);
+  admission_release(ADMIT_CONNECTION);
+}
+
+// Used on shutdown: closes this loop's clients without on_disconnect
+void connection_close_all(void (*close_one)(Connection *conn))
+{
+  for (int fd = 0; fd < connection_capacity; fd++)
+  {
+    if (connections[fd] != NULL && atomic_load(&fd_owners[fd]) == current_loop)
+    {
+      Connection *conn = connections[fd];
+      connection_forget(fd);
+      admission_release(ADMIT_CONNECTION);
+      close_one(conn);
+    }
+  }
+}
+
+// Call fn for every socket client of the current loop
+void connection_for_each(void (*fn)(Connection *conn))
+{
+  for (int fd = 0; fd < connection_capacity; fd++)
+  {
+    if (connections[fd] != NULL && connections[fd]->loopback == NULL && atomic_load(&fd_owners[fd]) == current_loop)
+      fn(connections[fd]);
+  }
+}
+
+// Read every pending signal; returns 1 if on_signal asked to stop
+int dispatch_signals(int signal_fd)
+{
+  struct signalfd_siginfo info;
+  int stop = 0;
+  while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+  {
+    if (current_loop->on_signal((int)info.ssi_signo))
+      stop = 1;
+  }
+  return stop;
+}
+
+/*****************************TIMERS*************************************/
+
+// Wheel ticks are CLOCK_MONOTONIC milliseconds, the clock timer_fd runs on
+static uint64_t monotonic_ms(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+// Point timer_fd at the wheel's next deadline. Cancelling never re-arms, so
+// the fd may fire with nothing due; it is then simply set again.
+static void arm_timer_fd(EventLoop *loop)
+{
+  uint64_t next = timer_wheel_next(&loop->timers);
+  if (next == loop->timer_armed)
+    return;
+
+  struct itimerspec spec = {0}; // All zero disarms
+  if (next != UINT64_MAX)
+  {
+    spec.it_value.tv_sec = (time_t)(next / 1000);
+    spec.it_value.tv_nsec = (long)(next % 1000) * 1000000;
+  }
+  if (timerfd_settime(loop->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0)
+  {
+    perror("timerfd_settime");
+    return;
+  }
+  loop->timer_armed = next;
+}
+
+void event_loop_timer_start(Timer *timer, long delay_ms)
+{
+  EventLoop *loop = current_loop;
+  uint64_t now = monotonic_ms();
+  timer_wheel_cancel(&loop->timers, timer);
+  if (loop->timers.count == 0)
+    loop->timers.now = now; // Idle wheel: catch up without walking the gap
+  timer_wheel_add(&loop->timers, timer, now + (delay_ms > 0 ? (uint64_t)delay_ms : 0));
+  if (timer->expires < loop->timer_armed)
+    arm_timer_fd(loop);
+}
+
+void event_loop_timer_cancel(Timer *timer)
+{
+  timer_wheel_cancel(&current_loop->timers, timer);
+}
+
+long event_loop_timer_remaining(const Timer *timer)
+{
+  if (!timer_pending(timer))
+    return -1;
+  uint64_t now = monotonic_ms();
+  return timer->expires > now ? (long)(timer->expires - now) : 0;
+}
+
+void dispatch_timers(void)
+{
+  EventLoop *loop = current_loop;
+  uint64_t expirations;
+  while (read(loop->timer_fd, &expirations, sizeof(expirations)) > 0)
+    ;
+  loop->timer_armed = UINT64_MAX; // A fired absolute timer stays disarmed
+  timer_wheel_advance(&loop->timers, monotonic_ms());
+  arm_timer_fd(loop);
+}
+
+/*****************************MAILBOX*************************************/
+
+int event_loop_open(EventLoop *loop)
+{
+  loop->mailbox_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (loop->mailbox_fd < 0)
+  {
+    perror("eventfd");
+    return -1;
+  }
+  pthread_mutex_init(&loop->mailbox_lock, NULL);
+  loop->mailbox_head = loop->mailbox_tail = NULL;
+  atomic_init(&loop->stopping, 0);
+
+  loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (loop->timer_fd < 0)
+  {
+    perror("timerfd_create");
+    return -1;
+  }
+  loop->timer_armed = UINT64_MAX;
+  timer_wheel_init(&loop->timers, monotonic_ms());
+  return 0;
+}
+
+static void mailbox_push(EventLoop *loop, MailItem *item);
+static int send_frame(int fd, unsigned generation, Frame *frame);
+
+static int post_handler(EventLoop *loop, MailHandler handler, int fd, unsigned generation, const Message *message)
+{
+  MessageMail *mail = malloc(sizeof(MessageMail));
+  if (mail == NULL)
+    return -1;
+  mail->item.next = NULL;
+  mail->item.handler = handler;
+  mail->item.fd = fd;
+  mail->item.generation = generation;
+  memcpy(&mail->message, message, sizeof(Message));
+  mailbox_push(loop, &mail->item);
+  return 0;
+}
+
+int event_loop_post(EventLoop *loop, MailHandler handler, int fd, const Message *message)
+{
+  return post_handler(loop, handler, fd, 0, message);
+}
+
+int event_loop_post_client(EventLoop *loop, MailHandler handler, int fd, const Message *message)
+{
+  unsigned generation = event_loop_generation(fd);
+  if (generation == 0)
+    return -1;
+  return post_handler(loop, handler, fd, generation, message);
+}
+
+// Hand a shared frame to the loop owning fd; the item holds a reference
+static int post_frame(EventLoop *loop, int fd, unsigned generation, Frame *frame)
+{
+  FrameMail *mail = malloc(sizeof(FrameMail));
+  if (mail == NULL)
+    return -1;
+  atomic_fetch_add(&frame->refs, 1);
+  mail->item.next = NULL;
+  mail->item.handler = NULL;
+  mail->item.fd = fd;
+  mail->item.generation = generation;
+  mail->frame = frame;
+  mailbox_push(loop, &mail->item);
+  return 0;
+}
+
+static void mailbox_push(EventLoop *loop, MailItem *item)
+{
+  pthread_mutex_lock(&loop->mailbox_lock);
+  int was_empty = loop->mailbox_head == NULL;
+  if (loop->mailbox_tail != NULL)
+    loop->mailbox_tail->next = item;
+  else
+    loop->mailbox_head = item;
+  loop->mailbox_tail = item;
+  pthread_mutex_unlock(&loop->mailbox_lock);
+
+  // The owner empties the whole list per wakeup, so only the first post wakes it
+  uint64_t one = 1;
+  if (was_empty && write(loop->mailbox_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    perror("eventfd write");
+}
+
+void event_loop_stop(EventLoop *loop)
+{
+  atomic_store(&loop->stopping, 1);
+  uint64_t one = 1;
+  if (write(loop->mailbox_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    perror("eventfd write");
+}
+
+void dispatch_mailbox(void)
+{
+  EventLoop *loop = current_loop;
+  uint64_t count;
+  while (read(loop->mailbox_fd, &count, sizeof(count)) > 0)
+    ;
+
+  pthread_mutex_lock(&loop->mailbox_lock);
+  MailItem *item = loop->mailbox_head;
+  loop->mailbox_head = loop->mailbox_tail = NULL;
+  pthread_mutex_unlock(&loop->mailbox_lock);
+
+  while (item != NULL)
+  {
+    MailItem *next = item->next;
+    if (item->handler == NULL)
+    {
+      FrameMail *mail = (FrameMail *)item;
+      send_frame(item->fd, item->generation, mail->frame);
+      frame_release(mail->frame);
+    }
+    else if (item->generation == 0)
+    {
+      item->handler(item->fd, &((MessageMail *)item)->message);
+    }
+    else if (event_loop_generation(item->fd) == item->generation)
+    {
+      // The client may still close meanwhile: sends to fd stay bound to it
+      mail_fd = item->fd;
+      mail_generation = item->generation;
+      item->handler(item->fd, &((MessageMail *)item)->message);
+      mail_fd = -1;
+    }
+    free(item);
+    item = next;
+  }
+}
+
+static int epoll_send(Connection *conn, Frame *frame);
+
+static int loopback_deliver(Connection *conn, Frame *frame)
+{
+  Message message;
+  if (message_decode(frame->data, frame->len, &message) <= 0)
+    return -1;
+  conn->loopback(conn->fd, &message, conn->loopback_ctx);
+  return 0;
+}
+
+// Only to the connection of that generation: fd may already be another
+// client's, even on another loop
+static int send_frame(int fd, unsigned generation, Frame *frame)
+{
+  EventLoop *owner = fd >= 0 && fd < connection_capacity ? atomic_load(&fd_owners[fd]) : NULL;
+  if (owner == NULL || generation == 0)
+    return -1;
+  // A connection's queue is only touched by the loop that owns it
+  if (owner != current_loop)
+    return post_frame(owner, fd, generation, frame);
+  if (connections[fd]->generation != generation)
+    return -1;
+  if (connections[fd]->loopback != NULL)
+    return loopback_deliver(connections[fd], frame);
+#ifdef HAVE_IO_URING
+  if (owner->backend == EVENT_BACKEND_IO_URING)
+    return uring_send(connections[fd], frame);
+#endif
+  return epoll_send(connections[fd], frame);
+}
+
+int send_message(int fd, const Message *message)
+{
+  return broadcast_message(&fd, NULL, 1, message);
+}
+
+int broadcast_message(const int *fds, const unsigned *generations, int count, const Message *message)
+{
+  Frame *frame = frame_create(message);
+  if (frame == NULL)
+    return -1;
+  int rc = 0;
+  for (int i = 0; i < count; i++)
+  {
+    if (fds[i] < 0)
+      continue;
+    unsigned generation = generations != NULL ? generations[i] : event_loop_generation(fds[i]);
+    if (send_frame(fds[i], generation, frame) < 0)
+      rc = -1;
+  }
+  frame_release(frame);
+  return rc;
+}
+
+/*****************************LOOPBACK*************************************/
+
+int event_loop_loopback_open(LoopbackHandler on_reply, void *ctx)
+{
+  if (!admission_acquire(ADMIT_CONNECTION))
+    return -1;
+  int fd = eventfd(0, EFD_CLOEXEC); // Never read or written, no backend watches it
+  Connection *conn = fd >= 0 ? connection_create(fd, current_loop) : NULL;
+  if (conn == NULL)
+  {
+    if (fd >= 0)
+      close(fd);
+    admission_release(ADMIT_CONNECTION);
+    return -1;
+  }
+  conn->loopback = on_reply;
+  conn->loopback_ctx = ctx;
+  return fd;
+}
+
+int event_loop_loopback_request(int fd, const Message *message)
+{
+  EventLoop *owner = fd >= 0 && fd < connection_capacity ? atomic_load(&fd_owners[fd]) : NULL;
+  if (owner == NULL)
+    return -1;
+  return event_loop_post_client(owner, owner->on_message, fd, message);
+}
+
+void event_loop_loopback_close(int fd)
+{
+  Connection *conn = connection_get(fd);
+  if (conn == NULL || conn->loopback == NULL)
+    return;
+  connection_detach(conn);
+  close(fd);
+  free(conn);
+}
+
+/*****************************HANDOFF*************************************/
+
+void event_loop_settle(EventLoop *loops, int count)
+{
+  EventLoop *saved = current_loop;
+  int busy = 1;
+  while (busy)
+  {
+    busy = 0;
+    for (int i = 0; i < count; i++)
+    {
+      if (loops[i].mailbox_head == NULL)
+        continue;
+      current_loop = &loops[i]; // Handlers and sends act as that loop
+      dispatch_mailbox();
+      busy = 1;
+    }
+  }
+  current_loop = saved;
+}
+
+int event_loop_export_clients(int (*fn)(const ClientState *client, void *ctx), void *ctx)
+{
+  for (int fd = 0; fd < connection_capacity; fd++)
+  {
+    Connection *conn = connections[fd];
+    if (conn == NULL || conn->loopback != NULL)
+      continue;
+
+    ClientState client = {.fd = fd, .in_data = conn->in_buf, .in_len = conn->in_len, .out_len = conn->out_bytes};
+    char *out = conn->out_bytes > 0 ? malloc(conn->out_bytes) : NULL;
+    if (conn->out_bytes > 0 && out == NULL)
+      return -1;
+    size_t copied = 0, skip = conn->head_sent;
+    for (OutboxEntry *entry = conn->send_head; entry != NULL; entry = entry->next)
+    {
+      memcpy(out + copied, entry->frame->data + skip, entry->frame->len - skip);
+      copied += entry->frame->len - skip;
+      skip = 0;
+    }
+    client.out_data = out;
+
+    int rc = fn(&client, ctx);
+    free(out);
+    if (rc != 0)
+      return rc;
+  }
+  return 0;
+}
+
+int event_loop_adopt_client(EventLoop *loop, const ClientState *client)
+{
+  if (client->in_len > MESSAGE_MAX_FRAME || client->out_len > OUTBOX_LIMIT)
+    return -1;
+  // The unsent replies go out as one frame; they are already encoded.
+  // Allocated first so that failing leaves no connection to undo.
+  Frame *frame = NULL;
+  if (client->out_len > 0)
+  {
+    frame = malloc(sizeof(Frame) + client->out_len);
+    if (frame == NULL)
+      return -1;
+    atomic_init(&frame->refs, 1);
+    frame->len = client->out_len;
+    memcpy(frame->data, client->out_data, client->out_len);
+  }
+
+  Connection *conn = connection_create(client->fd, loop);
+  if (conn == NULL)
+  {
+    free(frame);
+    return -1;
+  }
+  admission_add(ADMIT_CONNECTION);
+
+  memcpy(conn->in_buf, client->in_data, client->in_len);
+  conn->in_len = client->in_len;
+  if (frame != NULL)
+  {
+    connection_queue(conn, frame);
+    frame_release(frame);
+  }
+  return 0;
+}
+
+void event_loop_cancel_handoff(EventLoop *loops, int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    loops[i].keep_clients = 0;
+    atomic_store(&loops[i].stopping, 0);
+  }
+}
+
+/*****************************EPOLL BACKEND*************************************/
+
+static __thread int epoll_fd = -1;
+
+static int epoll_watch(int fd, uint32_t events)
+{
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.fd = fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+  {
+    perror("epoll_ctl");
+    return -1;
+  }
+  return 0;
+}
+
+// Watch a client this loop did not accept itself; epoll reports what is
+// already pending on it, queued replies included. io_uring accepts blocking
+// sockets, so a client it handed over is made non-blocking first.
+static void epoll_resume(Connection *conn)
+{
+  int flags = fcntl(conn->fd, F_GETFL);
+  if (flags < 0 || fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK) < 0 ||
+      epoll_watch(conn->fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) < 0)
+    connection_abort(conn, "cannot watch");
+}
+
+static void epoll_close_one(Connection *conn)
+{
+  close(conn->fd); // close() also removes the fd from epoll
+  connection_free_sends(conn);
+  free(conn);
+}
+
+// Write queued frames until the socket is full, up to SEND_BATCH per call.
+// Returns -1 on a socket error.
+static int epoll_flush(Connection *conn)
+{
+  struct iovec iov[SEND_BATCH];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  while (conn->send_head != NULL)
+  {
+    msg.msg_iovlen = connection_fill_iov(conn, iov, SEND_BATCH);
+    ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    connection_consume(conn, (size_t)n);
+  }
+  return 0;
+}
+
+// Sends go out right away; only what the socket cannot take waits for EPOLLOUT
+static int epoll_send(Connection *conn, Frame *frame)
+{
+  int rc = connection_queue(conn, frame);
+  if (rc <= 0)
+    return rc;
+  if (epoll_flush(conn) < 0)
+  {
+    connection_abort(conn, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+// The socket has room again. Returns 1 if reads should resume.
+static int epoll_writable(Connection *conn)
+{
+  if (epoll_flush(conn) < 0)
+    connection_abort(conn, strerror(errno));
+  if (conn->paused && conn->out_bytes <= OUTBOX_LOW_WATERMARK)
+  {
+    conn->paused = 0;
+    return 1;
+  }
+  return conn->aborted;
+}
+
+static void epoll_accept(int listen_fd)
+{
+  while (1)
+  {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+    {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("Accept failed");
+      return;
+    }
+    Connection *conn = connection_open(fd);
+    if (conn == NULL)
+    {
+      close(fd);
+    }
+    else if (epoll_watch(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) < 0)
+    {
+      printf("Cannot track connection %d, closing\n", fd);
+      connection_forget(fd);
+      admission_release(ADMIT_CONNECTION);
+      free(conn);
+      close(fd);
+    }
+  }
+}
+
+// Edge-triggered: read until EAGAIN or there will be no further event. A
+// paused client's bytes stay in the socket; epoll_writable resumes it.
+static void epoll_read(Connection *conn)
+{
+  char buf[RECV_CHUNK];
+  while (!conn->paused)
+  {
+    ssize_t n = recv(conn->fd, buf, sizeof(buf), 0);
+    if (n > 0 && connection_feed(conn, buf, (size_t)n) == 0)
+      continue;
+    if (n > 0)
+      printf("Malformed frame from %d, closing\n", conn->fd);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    connection_detach(conn); // Client closed, socket error or malformed frame
+    epoll_close_one(conn);
+    return;
+  }
+}
+
+static int epoll_run(EventLoop *loop)
+{
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0)
+  {
+    perror("epoll_create1");
+    return -1;
+  }
+  if (epoll_watch(loop->listen_fd, EPOLLIN | EPOLLET) < 0 ||
+      (loop->local_fd >= 0 && epoll_watch(loop->local_fd, EPOLLIN | EPOLLET) < 0) ||
+      epoll_watch(loop->mailbox_fd, EPOLLIN | EPOLLET) < 0 ||
+      epoll_watch(loop->timer_fd, EPOLLIN | EPOLLET) < 0 ||
+      (loop->signal_fd >= 0 && epoll_watch(loop->signal_fd, EPOLLIN | EPOLLET) < 0) ||
+      (loop->wakeup_fd >= 0 && epoll_watch(loop->wakeup_fd, EPOLLIN | EPOLLET) < 0))
+  {
+    close(epoll_fd);
+    return -1;
+  }
+
+  connection_for_each(epoll_resume); // Clients kept over a handoff
+
+  struct epoll_event events[MAX_EVENTS];
+  while (!atomic_load(&loop->stopping))
+  {
+    int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+    if (ready == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
+      break;
+    }
+
+    for (int i = 0; i < ready; i++)
+    {
+      int fd = events[i].data.fd;
+      if (fd == loop->listen_fd || fd == loop->local_fd)
+      {
+        epoll_accept(fd);
+      }
+      else if (fd == loop->mailbox_fd)
+      {
+        dispatch_mailbox();
+      }
+      else if (fd == loop->timer_fd)
+      {
+        dispatch_timers();
+      }
+      else if (fd == loop->signal_fd)
+      {
+        if (dispatch_signals(loop->signal_fd))
+          atomic_store(&loop->stopping, 1);
+      }
+      else if (fd == loop->wakeup_fd)
+      {
+        loop->on_wakeup();
+      }
+      else
+      {
+        Connection *conn = connection_get(fd);
+        if (conn == NULL)
+          continue;
+        uint32_t ev = events[i].events;
+        int readable = (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0;
+        if (ev & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+          readable |= epoll_writable(conn);
+        if (readable)
+          epoll_read(conn);
+      }
+    }
+  }
+
+  if (!loop->keep_clients)
+    connection_close_all(epoll_close_one);
+  close(epoll_fd);
+  epoll_fd = -1;
+  return 0;
+}
+
+/***************************************************************************/
+
+const char *event_backend_name(EventBackend backend)
+{
+  return backend == EVENT_BACKEND_IO_URING ? "io_uring" : "epoll";
+}
+
+EventLoop *event_loop_current(void)
+{
+  return current_loop;
+}
+
+void event_loop_stop_accepting(void)
+{
+  EventLoop *loop = current_loop;
+  if (loop->listen_fd < 0)
+    return;
+#ifdef HAVE_IO_URING
+  if (loop->backend == EVENT_BACKEND_IO_URING)
+    uring_stop_accepting(); // The accepts hold their own reference until cancelled
+#endif
+  if (loop->backend == EVENT_BACKEND_EPOLL)
+  {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, loop->listen_fd, NULL);
+    if (loop->local_fd >= 0)
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, loop->local_fd, NULL);
+  }
+  close(loop->listen_fd);
+  loop->listen_fd = -1;
+  if (loop->local_fd >= 0)
+    close(loop->local_fd);
+  loop->local_fd = -1;
+}
+
+int event_loop_run(EventLoop *loop, EventBackend backend)
+{
+  current_loop = loop;
+  loop->backend = backend;
+  int rc = -1;
+#ifdef HAVE_IO_URING
+  if (backend == EVENT_BACKEND_IO_URING)
+    rc = uring_run(loop);
+#endif
+  if (backend == EVENT_BACKEND_EPOLL)
+    rc = epoll_run(loop);
+  if (rc < 0)
+    loop->backend = EVENT_BACKEND_EPOLL;
+  return rc;
+}
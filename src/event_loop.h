@@ -0,0 +1,139 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "model/message.h"
+#include "timer_wheel.h"
+
+// I/O backend for the server. Both backends accept clients, decode whole
+// frames (see model/message.h) into Messages and hand them to on_message, so
+// the server's handlers do not know which one is running.
+typedef enum
+{
+  EVENT_BACKEND_EPOLL,
+  EVENT_BACKEND_IO_URING, // Only when built with HAVE_IO_URING
+} EventBackend;
+
+typedef void (*MailHandler)(int fd, Message *message);
+typedef void (*LoopbackHandler)(int fd, const Message *message, void *ctx);
+typedef struct MailItem MailItem;
+typedef struct Frame Frame;
+
+// One loop per thread. Every loop owns the clients it accepted; work for
+// another loop is handed over through its mailbox (event_loop_post).
+typedef struct
+{
+  int index;     // Shard number
+  int listen_fd; // Non-blocking listening socket (SO_REUSEPORT when sharded)
+  int local_fd;  // Non-blocking AF_UNIX listening socket, -1 if none; each loop has its own fd
+  int signal_fd; // signalfd, each signal is passed to on_signal; -1 if none
+  int wakeup_fd; // Readable when on_wakeup has work (dictionary reload pipe); -1 if none
+  void (*on_message)(int fd, Message *message);
+  void (*on_disconnect)(int fd); // Called while fd is still open
+  void (*on_wakeup)(void);
+  int (*on_signal)(int signo); // Return 1 to stop the loop
+  int keep_clients;            // Set before stopping for a handoff: clients stay open for the next run
+
+  // Owned by event_loop.c
+  EventBackend backend;
+  int mailbox_fd; // eventfd
+  pthread_mutex_t mailbox_lock;
+  MailItem *mailbox_head;
+  MailItem *mailbox_tail;
+  atomic_int stopping;
+  int timer_fd;          // timerfd set for the wheel's next deadline
+  uint64_t timer_armed;  // Tick (CLOCK_MONOTONIC ms) timer_fd is set for, UINT64_MAX if none
+  TimerWheel timers;
+} EventLoop;
+
+// Call once before any loop starts; fds up to max_fds - 1 can be clients
+int event_loop_init(int max_fds);
+// Set up a loop's mailbox so others can post to it before it runs
+int event_loop_open(EventLoop *loop);
+
+// Runs until on_signal or event_loop_stop asks to stop. Returns 0 then, or -1
+// if the backend could not be set up (nothing has been accepted yet, so the
+// caller may try another backend).
+int event_loop_run(EventLoop *loop, EventBackend backend);
+void event_loop_stop(EventLoop *loop);
+// Close the current loop's listening sockets (listen_fd and local_fd become
+// -1); clients already accepted are served as before
+void event_loop_stop_accepting(void);
+EventLoop *event_loop_current(void);
+const char *event_backend_name(EventBackend backend);
+
+// Call timer->callback on the current loop's thread once delay_ms have passed.
+// Starting a pending timer moves its deadline. Timers belong to the loop that
+// started them and are only started or cancelled from its thread.
+void event_loop_timer_start(Timer *timer, long delay_ms);
+void event_loop_timer_cancel(Timer *timer);
+
+// Milliseconds until a pending timer is due (0 if overdue), -1 if not pending
+long event_loop_timer_remaining(const Timer *timer);
+
+// Run handler(fd, copy of message) on loop's thread, in posting order
+int event_loop_post(EventLoop *loop, MailHandler handler, int fd, const Message *message);
+// The same for a request from client fd: dropped if that client is gone by
+// the time loop gets to it, and while handler runs fd means that client
+int event_loop_post_client(EventLoop *loop, MailHandler handler, int fd, const Message *message);
+
+// Every connection gets a new generation; the kernel reuses an fd number as
+// soon as its client is closed, (fd, generation) is never reused. Returns 0
+// if fd is not a client. Inside a handler run by event_loop_post_client, the
+// generation of the client that posted it.
+unsigned event_loop_generation(int fd);
+
+// Send one Message to a client from any loop without blocking. It is queued
+// on the connection, on the loop that owns fd, and written as the socket
+// allows; messages to one client keep their order. Goes to the client on fd
+// as event_loop_generation(fd) sees it now.
+int send_message(int fd, const Message *message);
+
+// Send the same Message to every fd in fds; entries < 0 are skipped. It is
+// encoded once and the frame is shared by all recipients' queues, whichever
+// loop owns them. With generations, fds[i] only gets it while it is still
+// the connection of generation generations[i]; NULL means the current ones.
+// Returns -1 if any recipient could not be queued.
+int broadcast_message(const int *fds, const unsigned *generations, int count, const Message *message);
+
+/* In-process clients (bots, benchmarks) */
+
+// Add a client to the current loop that has no socket: what it sends goes
+// straight to on_message through the mailbox, and every message sent to it is
+// passed to on_reply on this loop's thread, without being written anywhere.
+// Returns its fd, which only reserves the number, or -1.
+int event_loop_loopback_open(LoopbackHandler on_reply, void *ctx);
+// Queue message as if the client had sent it; callable from any loop
+int event_loop_loopback_request(int fd, const Message *message);
+// On the owning loop: tell on_disconnect and drop the client
+void event_loop_loopback_close(int fd);
+
+/* Handoff to a new server process (binary upgrade, see server.c) */
+
+// A client with the bytes the loop still holds for it: a request read only in
+// part, and replies not yet written
+typedef struct
+{
+  int fd;
+  const char *in_data;
+  size_t in_len;
+  const char *out_data;
+  size_t out_len;
+} ClientState;
+
+// Once every loop has stopped with keep_clients set: run what is still in
+// their mailboxes on the calling thread, so no request or reply is left there
+void event_loop_settle(EventLoop *loops, int count);
+// Then call fn for each client (out_data lives only for the call); stops at
+// and returns fn's first non-zero result. In-process clients are not included.
+int event_loop_export_clients(int (*fn)(const ClientState *client, void *ctx), void *ctx);
+// Before loop runs: take over a connected client and its pending bytes. The
+// next event_loop_run of loop serves it like one it accepted.
+int event_loop_adopt_client(EventLoop *loop, const ClientState *client);
+// The handoff failed: clear keep_clients and the stop request so the loops
+// can run again, serving the clients they kept
+void event_loop_cancel_handoff(EventLoop *loops, int count);
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef EVENT_LOOP_INTERNAL_H
+#define EVENT_LOOP_INTERNAL_H
+
+// Connection state shared by the epoll and io_uring backends
+
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "event_loop.h"
+
+// Outbound queue limits per client, in encoded bytes. Above the high
+// watermark the loop stops reading the client's requests (their replies would
+// only pile up) until the queue drains below the low one; a client whose queue
+// would pass the limit is dropped.
+#define OUTBOX_LOW_WATERMARK (16 * 1024)
+#define OUTBOX_HIGH_WATERMARK (64 * 1024)
+#define OUTBOX_LIMIT (256 * 1024)
+
+#define SEND_BATCH 64 // Queued frames handed to one sendmsg()
+
+// One encoded frame. It is never changed once built, so a broadcast puts the
+// same Frame on every recipient's queue; the last queue to let go frees it.
+struct Frame
+{
+  atomic_int refs;
+  size_t len;
+  char data[];
+};
+
+typedef struct OutboxEntry
+{
+  struct OutboxEntry *next;
+  Frame *frame;
+} OutboxEntry;
+
+// TCP may split or coalesce frames, so a partial frame is kept in in_buf
+// until the rest arrives
+typedef struct
+{
+  int fd;
+  unsigned generation; // See event_loop_generation
+  size_t in_len;
+  char in_buf[MESSAGE_MAX_FRAME];
+  // Frames not yet written, oldest first
+  OutboxEntry *send_head;
+  OutboxEntry *send_tail;
+  size_t head_sent; // Bytes of send_head's frame already written
+  size_t out_bytes; // Unsent bytes in the queue
+  int paused;       // Over the high watermark, reads are held back
+  int aborted;      // Being dropped: shut down, the backend closes it on hangup
+  int closed;       // io_uring: fd already closed, freed once the in-flight send completes
+  int reading;      // io_uring: a multishot recv is armed
+  int cancelling;   // io_uring: a cancel for that recv is in flight
+  int sending;      // io_uring: a sendmsg is in flight
+  LoopbackHandler loopback; // In-process client: replies go here, the fd only holds the number
+  void *loopback_ctx;
+  // io_uring: the sendmsg in flight points here and into the queued frames
+  struct msghdr send_msg;
+  struct iovec send_iov[SEND_BATCH];
+} Connection;
+
+// Head of a mailbox entry: a MessageMail runs handler(fd, &message), a
+// FrameMail (handler NULL) queues its frame for fd. A non-zero generation
+// ties the item to the client that held fd when it was posted: it is dropped
+// if that client is gone by delivery.
+struct MailItem
+{
+  struct MailItem *next;
+  MailHandler handler;
+  int fd;
+  unsigned generation;
+};
+
+typedef struct
+{
+  MailItem item;
+  Message message;
+} MessageMail;
+
+// Broadcasts post one per recipient on another loop, so no Message is carried
+typedef struct
+{
+  MailItem item;
+  Frame *frame;
+} FrameMail;
+
+extern __thread EventLoop *current_loop;
+
+Connection *connection_open(int fd);
+Connection *connection_get(int fd);
+int connection_feed(Connection *conn, const char *data, size_t len);
+int connection_queue(Connection *conn, Frame *frame);
+int connection_fill_iov(Connection *conn, struct iovec *iov, int max);
+void connection_consume(Connection *conn, size_t sent);
+void connection_free_sends(Connection *conn);
+void connection_abort(Connection *conn, const char *reason);
+void connection_detach(Connection *conn);
+void connection_close_all(void (*close_one)(Connection *conn));
+void connection_for_each(void (*fn)(Connection *conn));
+int dispatch_signals(int signal_fd);
+void dispatch_mailbox(void);
+void dispatch_timers(void);
+
+#ifdef HAVE_IO_URING
+int uring_run(EventLoop *loop);
+int uring_send(Connection *conn, Frame *frame);
+void uring_stop_accepting(void);
+#endif
+
+#endif
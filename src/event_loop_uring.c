@@ -0,0 +1,584 @@
+#ifdef HAVE_IO_URING
+
+// io_uring backend, driven through the raw syscalls so liburing is not needed.
+// One multishot accept, one multishot recv per client reading into a ring of
+// provided buffers, and sends queued as SQEs that go to the kernel together
+// with the next io_uring_enter().
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "event_loop_internal.h"
+
+#define URING_ENTRIES 1024
+#define RECV_BUFFER_COUNT 1024 // Power of two (buffer ring size)
+#define RECV_BUFFER_SIZE 4096
+#define RECV_GROUP 0
+
+// user_data = pointer | operation; pointers from malloc are 16-byte aligned
+// (max_align_t on 64-bit), keeping the low 4 bits free
+enum
+{
+  OP_ACCEPT = 1,
+  OP_SIGNAL = 2,
+  OP_WAKEUP = 3,
+  OP_RECV = 4,
+  OP_SEND = 5,
+  OP_MAILBOX = 6,
+  OP_CANCEL = 7,
+  OP_TIMER = 8,
+  OP_ACCEPT_LOCAL = 9, // Accept on local_fd
+};
+#define OP_MASK 15u
+
+// One ring per loop thread
+static __thread struct
+{
+  int fd;
+  void *ring;
+  size_t ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned sq_local_tail; // SQEs filled in but not yet published to the kernel
+  unsigned to_submit;
+  struct io_uring_buf_ring *buffers;
+  size_t buffers_size;
+  char *buffer_memory;
+  int accepting;  // Multishot accepts armed
+  int quiescing;  // Handoff: let every operation end, arm nothing new
+} uring = {.fd = -1};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*****************************RING SETUP*************************************/
+
+static void uring_teardown()
+{
+  if (uring.buffers != NULL)
+    munmap(uring.buffers, uring.buffers_size);
+  free(uring.buffer_memory);
+  if (uring.sqes != NULL)
+    munmap(uring.sqes, uring.sqes_size);
+  if (uring.ring != NULL)
+    munmap(uring.ring, uring.ring_size);
+  if (uring.fd >= 0)
+    close(uring.fd);
+  memset(&uring, 0, sizeof(uring));
+  uring.fd = -1;
+}
+
+static void recycle_buffer(unsigned short bid)
+{
+  unsigned short tail = uring.buffers->tail;
+  struct io_uring_buf *buf = &uring.buffers->bufs[tail & (RECV_BUFFER_COUNT - 1)];
+  buf->addr = (unsigned long)(uring.buffer_memory + (size_t)bid * RECV_BUFFER_SIZE);
+  buf->len = RECV_BUFFER_SIZE;
+  buf->bid = bid;
+  __atomic_store_n(&uring.buffers->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+// Register RECV_BUFFER_COUNT receive buffers the kernel picks from (5.19+)
+static int setup_buffer_ring()
+{
+  uring.buffers_size = sizeof(struct io_uring_buf) * RECV_BUFFER_COUNT;
+  uring.buffers = mmap(NULL, uring.buffers_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (uring.buffers == MAP_FAILED)
+  {
+    uring.buffers = NULL;
+    return -1;
+  }
+  uring.buffer_memory = malloc((size_t)RECV_BUFFER_COUNT * RECV_BUFFER_SIZE);
+  if (uring.buffer_memory == NULL)
+    return -1;
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long)uring.buffers;
+  reg.ring_entries = RECV_BUFFER_COUNT;
+  reg.bgid = RECV_GROUP;
+  if (sys_io_uring_register(uring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    return -1;
+
+  for (unsigned bid = 0; bid < RECV_BUFFER_COUNT; bid++)
+    recycle_buffer((unsigned short)bid);
+  return 0;
+}
+
+static int uring_setup()
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  uring.fd = sys_io_uring_setup(URING_ENTRIES, &params);
+  if (uring.fd < 0)
+    return -1;
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP))
+    return -1;
+
+  // SQ and CQ rings share one mapping (IORING_FEAT_SINGLE_MMAP)
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  uring.ring_size = sq_size > cq_size ? sq_size : cq_size;
+  uring.ring = mmap(NULL, uring.ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+  if (uring.ring == MAP_FAILED)
+  {
+    uring.ring = NULL;
+    return -1;
+  }
+  uring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  uring.sqes = mmap(NULL, uring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+  if (uring.sqes == MAP_FAILED)
+  {
+    uring.sqes = NULL;
+    return -1;
+  }
+
+  char *ring = uring.ring;
+  uring.sq_head = (unsigned *)(ring + params.sq_off.head);
+  uring.sq_tail = (unsigned *)(ring + params.sq_off.tail);
+  uring.sq_mask = (unsigned *)(ring + params.sq_off.ring_mask);
+  uring.sq_array = (unsigned *)(ring + params.sq_off.array);
+  uring.cq_head = (unsigned *)(ring + params.cq_off.head);
+  uring.cq_tail = (unsigned *)(ring + params.cq_off.tail);
+  uring.cq_mask = (unsigned *)(ring + params.cq_off.ring_mask);
+  uring.cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+  uring.sq_local_tail = *uring.sq_tail;
+
+  return setup_buffer_ring();
+}
+
+/*****************************SUBMISSION*************************************/
+
+// Publish the filled SQEs and enter the kernel once for all of them
+static int submit(unsigned wait_for)
+{
+  __atomic_store_n(uring.sq_tail, uring.sq_local_tail, __ATOMIC_RELEASE);
+  while (1)
+  {
+    int rc = sys_io_uring_enter(uring.fd, uring.to_submit, wait_for, wait_for ? IORING_ENTER_GETEVENTS : 0);
+    if (rc >= 0)
+    {
+      uring.to_submit -= (unsigned)rc < uring.to_submit ? (unsigned)rc : uring.to_submit;
+      return 0;
+    }
+    if (errno != EINTR)
+      return -1;
+  }
+}
+
+static struct io_uring_sqe *get_sqe()
+{
+  unsigned entries = *uring.sq_mask + 1;
+  if (uring.sq_local_tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) >= entries)
+    submit(0); // Ring full: hand the batch over before queueing more
+
+  unsigned index = uring.sq_local_tail & *uring.sq_mask;
+  struct io_uring_sqe *sqe = &uring.sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  uring.sq_array[index] = index;
+  uring.sq_local_tail++;
+  uring.to_submit++;
+  return sqe;
+}
+
+static void queue_accept(int listen_fd, unsigned op)
+{
+  struct io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listen_fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = op;
+  uring.accepting++;
+}
+
+static void queue_poll(int fd, unsigned op)
+{
+  struct io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = POLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = op;
+}
+
+static void queue_recv(Connection *conn)
+{
+  struct io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = RECV_GROUP;
+  sqe->user_data = (unsigned long)conn | OP_RECV;
+  conn->reading = 1;
+}
+
+// A paused client's recv is cancelled so its requests wait in the socket;
+// it ends with -ECANCELED. Bytes the multishot recv already delivered are
+// still handled, so a client pipelining far more than OUTBOX_LIMIT worth of
+// replies without reading may be dropped rather than paused.
+static void pause_reading(Connection *conn)
+{
+  if (!conn->reading || conn->cancelling)
+    return;
+  struct io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = (unsigned long)conn | OP_RECV;
+  sqe->user_data = OP_CANCEL;
+  conn->cancelling = 1;
+}
+
+// Draining: cancel the multishot accepts so the listening sockets can close
+void uring_stop_accepting(void)
+{
+  static const unsigned ops[] = {OP_ACCEPT, OP_ACCEPT_LOCAL};
+  for (int i = 0; i < 2; i++)
+  {
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = ops[i];
+    sqe->user_data = OP_CANCEL;
+  }
+}
+
+// The multishot recv ended; arm a new one unless the client is paused
+static void recv_stopped(Connection *conn)
+{
+  conn->reading = 0;
+  conn->cancelling = 0;
+  if (!conn->paused && !uring.quiescing)
+    queue_recv(conn);
+}
+
+// Everything queued so far, up to SEND_BATCH frames, goes in one sendmsg
+static void queue_send(Connection *conn)
+{
+  memset(&conn->send_msg, 0, sizeof(conn->send_msg));
+  conn->send_msg.msg_iov = conn->send_iov;
+  conn->send_msg.msg_iovlen = connection_fill_iov(conn, conn->send_iov, SEND_BATCH);
+  struct io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = conn->fd;
+  sqe->addr = (unsigned long)&conn->send_msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+  sqe->user_data = (unsigned long)conn | OP_SEND;
+  conn->sending = 1;
+}
+
+// Only one send per client is in flight so a slow client cannot reorder its
+// messages; frames queued meanwhile go out together with the next one.
+// Without a running ring (handing over) frames only wait in the queue.
+int uring_send(Connection *conn, Frame *frame)
+{
+  if (conn->closed)
+    return -1;
+  int rc = connection_queue(conn, frame);
+  if (uring.fd < 0 || uring.quiescing)
+    return rc < 0 ? -1 : 0;
+  if (rc < 0)
+  {
+    // Dropped: make sure a recv is armed to see the hangup
+    if (conn->aborted && !conn->reading)
+      queue_recv(conn);
+    return -1;
+  }
+  if (conn->paused)
+    pause_reading(conn);
+  if (rc == 1)
+    queue_send(conn);
+  return 0;
+}
+
+/*****************************COMPLETIONS*************************************/
+
+// The fd is closed here; the Connection itself waits for its in-flight send
+static void uring_close(Connection *conn)
+{
+  connection_detach(conn);
+  shutdown(conn->fd, SHUT_RDWR); // Fails a send the kernel still holds
+  close(conn->fd);
+  conn->closed = 1;
+  if (!conn->sending)
+  {
+    connection_free_sends(conn);
+    free(conn);
+  }
+}
+
+static void on_accept(EventLoop *loop, struct io_uring_cqe *cqe, unsigned op)
+{
+  if (cqe->res >= 0)
+  {
+    Connection *conn = connection_open(cqe->res);
+    if (conn == NULL)
+    {
+      close(cqe->res);
+    }
+    else if (!uring.quiescing)
+    {
+      queue_recv(conn);
+    }
+  }
+  else if (cqe->res != -EINTR && cqe->res != -ECONNABORTED && cqe->res != -ECANCELED)
+  {
+    fprintf(stderr, "Accept failed: %s\n", strerror(-cqe->res));
+  }
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+  {
+    uring.accepting--;
+    int listen_fd = op == OP_ACCEPT ? loop->listen_fd : loop->local_fd;
+    if (listen_fd >= 0 && !uring.quiescing)
+      queue_accept(listen_fd, op);
+  }
+}
+
+static void on_recv(Connection *conn, struct io_uring_cqe *cqe)
+{
+  if (cqe->res > 0)
+  {
+    unsigned short bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    if (connection_feed(conn, uring.buffer_memory + (size_t)bid * RECV_BUFFER_SIZE, (size_t)cqe->res) < 0)
+    {
+      // The multishot recv is still armed; it ends with res 0 and closes there
+      printf("Malformed frame from %d, closing\n", conn->fd);
+      shutdown(conn->fd, SHUT_RDWR);
+    }
+    recycle_buffer(bid);
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+      recv_stopped(conn);
+  }
+  else if (cqe->res == -ENOBUFS || cqe->res == -ECANCELED)
+  {
+    recv_stopped(conn); // ENOBUFS: every buffer was taken, they are back by now
+  }
+  else
+  {
+    uring_close(conn); // 0: client closed, < 0: socket error
+  }
+}
+
+static void on_send(Connection *conn, struct io_uring_cqe *cqe)
+{
+  conn->sending = 0;
+  if (conn->closed)
+  {
+    connection_free_sends(conn);
+    free(conn);
+    return;
+  }
+  if (cqe->res == -ECANCELED)
+    return; // Quiescing: the frames stay queued for the next process
+  if (cqe->res < 0)
+  {
+    connection_free_sends(conn);
+    connection_abort(conn, strerror(-cqe->res));
+    if (!conn->reading && !uring.quiescing)
+      queue_recv(conn);
+    return;
+  }
+
+  connection_consume(conn, (size_t)cqe->res);
+  if (uring.quiescing)
+    return;
+  if (conn->send_head != NULL)
+    queue_send(conn);
+  if (conn->paused && conn->out_bytes <= OUTBOX_LOW_WATERMARK)
+  {
+    conn->paused = 0;
+    if (!conn->reading)
+      queue_recv(conn);
+  }
+}
+
+// Returns 1 when a signal asked the loop to stop
+static int reap_completions(EventLoop *loop)
+{
+  int stop = 0;
+  unsigned head = *uring.cq_head;
+  unsigned tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++)
+  {
+    struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+    unsigned op = (unsigned)(cqe->user_data & OP_MASK);
+    Connection *conn = (Connection *)(unsigned long)(cqe->user_data & ~(unsigned long long)OP_MASK);
+
+    switch (op)
+    {
+    case OP_ACCEPT:
+    case OP_ACCEPT_LOCAL:
+      on_accept(loop, cqe, op);
+      break;
+    case OP_MAILBOX:
+      dispatch_mailbox();
+      if (!(cqe->flags & IORING_CQE_F_MORE))
+        queue_poll(loop->mailbox_fd, OP_MAILBOX);
+      break;
+    case OP_TIMER:
+      dispatch_timers();
+      if (!(cqe->flags & IORING_CQE_F_MORE))
+        queue_poll(loop->timer_fd, OP_TIMER);
+      break;
+    case OP_SIGNAL:
+      if (dispatch_signals(loop->signal_fd))
+        stop = 1;
+      if (!(cqe->flags & IORING_CQE_F_MORE))
+        queue_poll(loop->signal_fd, OP_SIGNAL);
+      break;
+    case OP_WAKEUP:
+      loop->on_wakeup();
+      if (!(cqe->flags & IORING_CQE_F_MORE))
+        queue_poll(loop->wakeup_fd, OP_WAKEUP);
+      break;
+    case OP_RECV:
+      on_recv(conn, cqe);
+      break;
+    case OP_SEND:
+      on_send(conn, cqe);
+      break;
+    case OP_CANCEL:
+      break; // The cancelled recv reports itself
+    }
+  }
+  __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+  return stop;
+}
+
+static void uring_close_one(Connection *conn)
+{
+  close(conn->fd);
+  connection_free_sends(conn);
+  free(conn);
+}
+
+/*****************************HANDOFF*************************************/
+
+// Arm the operations of a client taken over from another ring or process
+static void uring_resume(Connection *conn)
+{
+  if (!conn->paused || conn->aborted)
+    queue_recv(conn);
+  if (conn->send_head != NULL)
+    queue_send(conn);
+}
+
+static void cancel_io(Connection *conn)
+{
+  pause_reading(conn);
+  if (conn->sending)
+  {
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)conn | OP_SEND;
+    sqe->user_data = OP_CANCEL;
+  }
+}
+
+static __thread int busy_clients;
+
+static void count_busy(Connection *conn)
+{
+  if (conn->reading || conn->sending)
+    busy_clients++;
+}
+
+// The clients stay open for the next process, which must know exactly what
+// was read from and written to each. Cancel every recv, send and the accept
+// (the listening socket stays open too) and reap until all of them ended.
+static void uring_quiesce(EventLoop *loop)
+{
+  uring.quiescing = 1;
+  if (uring.accepting)
+    uring_stop_accepting();
+  connection_for_each(cancel_io);
+  while (1)
+  {
+    busy_clients = 0;
+    connection_for_each(count_busy);
+    if (busy_clients == 0 && uring.accepting == 0)
+      break;
+    if (submit(1) < 0)
+    {
+      perror("io_uring_enter");
+      break;
+    }
+    reap_completions(loop);
+  }
+}
+
+/***************************************************************************/
+
+int uring_run(EventLoop *loop)
+{
+  if (uring_setup() < 0)
+  {
+    fprintf(stderr, "io_uring setup failed: %s\n", strerror(errno));
+    uring_teardown();
+    return -1;
+  }
+
+  if (loop->listen_fd >= 0)
+    queue_accept(loop->listen_fd, OP_ACCEPT);
+  if (loop->local_fd >= 0)
+    queue_accept(loop->local_fd, OP_ACCEPT_LOCAL);
+  queue_poll(loop->mailbox_fd, OP_MAILBOX);
+  queue_poll(loop->timer_fd, OP_TIMER);
+  if (loop->signal_fd >= 0)
+    queue_poll(loop->signal_fd, OP_SIGNAL);
+  if (loop->wakeup_fd >= 0)
+    queue_poll(loop->wakeup_fd, OP_WAKEUP);
+  connection_for_each(uring_resume); // Clients kept over a handoff
+
+  while (!atomic_load(&loop->stopping))
+  {
+    // Everything queued since the last wakeup (sends to many clients, re-armed
+    // receives) goes in with this one call
+    if (submit(1) < 0)
+    {
+      perror("io_uring_enter");
+      break;
+    }
+    if (reap_completions(loop))
+      atomic_store(&loop->stopping, 1);
+  }
+
+  if (loop->keep_clients)
+    uring_quiesce(loop);
+
+  // Closing the ring first cancels whatever still points at our buffers
+  int ring_fd = uring.fd;
+  uring.fd = -1;
+  close(ring_fd);
+  if (!loop->keep_clients)
+    connection_close_all(uring_close_one);
+  uring_teardown();
+  return 0;
+}
+
+#endif
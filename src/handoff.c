@@ -0,0 +1,175 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "handoff.h"
+
+#define PACKET_SIZE (32 * 1024) // Well under the default socket buffer
+
+typedef struct
+{
+  uint32_t type;
+  uint32_t fd_count;
+  uint64_t len; // Whole payload, across packets
+} RecordHeader;
+
+int handoff_socketpair(int pair[2])
+{
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair) < 0)
+    return -1;
+  if (fcntl(pair[0], F_SETFD, FD_CLOEXEC) < 0)
+  {
+    close(pair[0]);
+    close(pair[1]);
+    return -1;
+  }
+  return 0;
+}
+
+static int send_packet(int sock, const RecordHeader *header, const char *data, size_t len, const int *fds, int fd_count)
+{
+  struct iovec iov[2];
+  int count = 0;
+  if (header != NULL)
+  {
+    iov[count].iov_base = (void *)header;
+    iov[count++].iov_len = sizeof(*header);
+  }
+  if (len > 0)
+  {
+    iov[count].iov_base = (void *)data;
+    iov[count++].iov_len = len;
+  }
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = count;
+  char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+  if (fd_count > 0)
+  {
+    memset(control, 0, sizeof(control));
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+  }
+
+  while (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0)
+  {
+    if (errno != EINTR)
+      return -1;
+  }
+  return 0;
+}
+
+int handoff_send(int sock, uint32_t type, const void *data, size_t len, const int *fds, int fd_count)
+{
+  if (fd_count < 0 || fd_count > HANDOFF_MAX_FDS || len > HANDOFF_MAX_RECORD)
+    return -1;
+  RecordHeader header = {.type = type, .fd_count = (uint32_t)fd_count, .len = len};
+  size_t chunk = len < PACKET_SIZE - sizeof(header) ? len : PACKET_SIZE - sizeof(header);
+  if (send_packet(sock, &header, data, chunk, fds, fd_count) < 0)
+    return -1;
+
+  for (size_t sent = chunk; sent < len; sent += chunk)
+  {
+    chunk = len - sent < PACKET_SIZE ? len - sent : PACKET_SIZE;
+    if (send_packet(sock, NULL, (const char *)data + sent, chunk, NULL, 0) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+static ssize_t recv_retry(int sock, struct msghdr *msg)
+{
+  ssize_t n;
+  while ((n = recvmsg(sock, msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+    ;
+  return n;
+}
+
+// Take the descriptors first so they are closed if the record is bad
+static void take_fds(struct msghdr *msg, HandoffRecord *record)
+{
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+  {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    int count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    for (int i = 0; i < count && record->fd_count < HANDOFF_MAX_FDS; i++)
+      memcpy(&record->fds[record->fd_count++], CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+  }
+}
+
+// The first got bytes of the payload came with the header
+static int read_payload(int sock, HandoffRecord *record, const char *first, size_t got)
+{
+  record->data = malloc(record->len > 0 ? record->len : 1);
+  if (record->data == NULL)
+    return -1;
+  memcpy(record->data, first, got);
+  while (got < record->len)
+  {
+    // The sender cut the rest into packets of exactly this size
+    size_t want = record->len - got < PACKET_SIZE ? record->len - got : PACKET_SIZE;
+    struct iovec iov = {record->data + got, want};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (recv_retry(sock, &msg) != (ssize_t)want || (msg.msg_flags & MSG_TRUNC))
+      return -1;
+    got += want;
+  }
+  return 0;
+}
+
+int handoff_recv(int sock, HandoffRecord *record)
+{
+  memset(record, 0, sizeof(*record));
+  RecordHeader header;
+  char *first = malloc(PACKET_SIZE);
+  if (first == NULL)
+    return -1;
+
+  struct iovec iov[2] = {{&header, sizeof(header)}, {first, PACKET_SIZE - sizeof(header)}};
+  char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t n = recv_retry(sock, &msg);
+  if (n > 0)
+    take_fds(&msg, record);
+
+  int rc = -1;
+  if (n >= (ssize_t)sizeof(header) && !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) &&
+      header.len <= HANDOFF_MAX_RECORD && (size_t)n - sizeof(header) <= header.len &&
+      (int)header.fd_count == record->fd_count)
+  {
+    record->type = header.type;
+    record->len = header.len;
+    rc = read_payload(sock, record, first, (size_t)n - sizeof(header));
+  }
+  free(first);
+  if (rc < 0)
+    handoff_record_free(record);
+  return rc;
+}
+
+void handoff_record_free(HandoffRecord *record)
+{
+  for (int i = 0; i < record->fd_count; i++)
+    close(record->fds[i]);
+  record->fd_count = 0;
+  free(record->data);
+  record->data = NULL;
+}
@@ -0,0 +1,37 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Transport for handing a running server over to a new process (binary
+// upgrade). Records go over a SOCK_SEQPACKET socketpair: the first packet has
+// a small header, the record's file descriptors (SCM_RIGHTS) and the start of
+// the payload; larger payloads continue in further packets. What the records
+// hold is up to the server (see server.c, UPGRADE).
+#define HANDOFF_MAGIC 0x46444E48u // "HNDF"
+#define HANDOFF_VERSION 1
+#define HANDOFF_MAX_FDS 128
+#define HANDOFF_MAX_RECORD (16 * 1024 * 1024)
+
+typedef struct
+{
+  uint32_t type;
+  size_t len;
+  char *data; // malloc'd, len bytes
+  int fds[HANDOFF_MAX_FDS];
+  int fd_count;
+} HandoffRecord;
+
+// Create the socketpair; pair[0] stays with the caller, pair[1] (inherited
+// across exec) goes to the new process. Returns 0 or -1.
+int handoff_socketpair(int pair[2]);
+// Send one record with up to HANDOFF_MAX_FDS descriptors. Returns 0 or -1.
+int handoff_send(int sock, uint32_t type, const void *data, size_t len, const int *fds, int fd_count);
+// Receive one record; received fds are close-on-exec. Returns 0, or -1 on
+// error or end of stream (nothing to free then).
+int handoff_recv(int sock, HandoffRecord *record);
+// Also closes the record's fds: set fd_count to 0 once they are taken
+void handoff_record_free(HandoffRecord *record);
+
+#endif
@@ -1,5 +1,444 @@
 /* Libs */
 
+#include <stdio.h>
+#include <string.h>
 #include "message.h"
 
 /* Functions */
+
+static void put_u16(char *out, unsigned value)
+{
+  out[0] = (char)((value >> 8) & 0xFF);
+  out[1] = (char)(value & 0xFF);
+}
+
+static unsigned get_u16(const char *in)
+{
+  return ((unsigned)(unsigned char)in[0] << 8) | (unsigned char)in[1];
+}
+
+size_t message_encode(const Message *message, char *frame)
+{
+  size_t length = message_is_binary(message->message_type) ? message->length : strnlen(message->payload, BUFFER_SIZE);
+  put_u16(frame, (unsigned)message->message_type);
+  put_u16(frame + 2, (unsigned)message->status);
+  put_u16(frame + 4, (unsigned)length);
+  memcpy(frame + MESSAGE_HEADER_SIZE, message->payload, length);
+  return MESSAGE_HEADER_SIZE + length;
+}
+
+int message_decode(const char *data, size_t len, Message *message)
+{
+  if (len < MESSAGE_HEADER_SIZE)
+    return 0;
+  size_t length = get_u16(data + 4);
+  enum MessageType type = (enum MessageType)get_u16(data);
+  // Text handlers need the NUL after the payload, so a text payload must leave room for it
+  if (length > BUFFER_SIZE || (length == BUFFER_SIZE && !message_is_binary(type)))
+    return -1;
+  if (len < MESSAGE_HEADER_SIZE + length)
+    return 0;
+  message->message_type = type;
+  message->status = (enum StatusCode)get_u16(data + 2);
+  message->length = (uint16_t)length;
+  memcpy(message->payload, data + MESSAGE_HEADER_SIZE, length);
+  if (length < BUFFER_SIZE)
+    message->payload[length] = '\0';
+  return (int)(MESSAGE_HEADER_SIZE + length);
+}
+
+/* Binary game payloads */
+
+int message_is_binary(enum MessageType type)
+{
+  switch (type)
+  {
+  case GAME_START:
+  case GAME_GUESS:
+  case GAME_TURN:
+  case GAME_END:
+  case GAME_GET_TARGET:
+  case GAME_UPDATE:
+  case GAME_SCORE:
+  case GAME_TIMEOUT:
+  case GAME_HINT:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+void message_set_text(Message *message, enum StatusCode status, const char *text)
+{
+  message->status = status;
+  snprintf(message->payload, sizeof(message->payload), "%s", text);
+  message->length = (uint16_t)strlen(message->payload);
+}
+
+// Writes never pass BUFFER_SIZE: the largest payload (HintReply) is about half of it
+typedef struct
+{
+  Message *message;
+  size_t pos;
+} Writer;
+
+typedef struct
+{
+  const Message *message;
+  size_t pos;
+  int error;
+} Reader;
+
+static void write_u8(Writer *w, unsigned value)
+{
+  w->message->payload[w->pos++] = (char)(value & 0xFF);
+}
+
+static void write_u16(Writer *w, unsigned value)
+{
+  put_u16(w->message->payload + w->pos, value);
+  w->pos += 2;
+}
+
+static void write_i32(Writer *w, int32_t value)
+{
+  uint32_t v = (uint32_t)value;
+  put_u16(w->message->payload + w->pos, v >> 16);
+  put_u16(w->message->payload + w->pos + 2, v & 0xFFFF);
+  w->pos += 4;
+}
+
+static void write_str(Writer *w, const char *text, size_t max)
+{
+  size_t len = strnlen(text, max - 1);
+  write_u8(w, (unsigned)len);
+  memcpy(w->message->payload + w->pos, text, len);
+  w->pos += len;
+}
+
+static void write_end(Writer *w)
+{
+  w->message->length = (uint16_t)w->pos;
+}
+
+static int has_bytes(Reader *r, size_t n)
+{
+  if (r->error || r->pos + n > r->message->length)
+  {
+    r->error = 1;
+    return 0;
+  }
+  return 1;
+}
+
+static unsigned read_u8(Reader *r)
+{
+  if (!has_bytes(r, 1))
+    return 0;
+  return (unsigned char)r->message->payload[r->pos++];
+}
+
+static unsigned read_u16(Reader *r)
+{
+  if (!has_bytes(r, 2))
+    return 0;
+  unsigned value = get_u16(r->message->payload + r->pos);
+  r->pos += 2;
+  return value;
+}
+
+static int32_t read_i32(Reader *r)
+{
+  if (!has_bytes(r, 4))
+    return 0;
+  uint32_t value = ((uint32_t)get_u16(r->message->payload + r->pos) << 16) | get_u16(r->message->payload + r->pos + 2);
+  r->pos += 4;
+  return (int32_t)value;
+}
+
+// out gets a NUL-terminated copy; size includes the NUL
+static void read_str(Reader *r, char *out, size_t size)
+{
+  size_t len = read_u8(r);
+  if (len >= size || !has_bytes(r, len))
+  {
+    r->error = 1;
+    out[0] = '\0';
+    return;
+  }
+  memcpy(out, r->message->payload + r->pos, len);
+  out[len] = '\0';
+  r->pos += len;
+}
+
+static void writer_init(Writer *w, Message *message)
+{
+  w->message = message;
+  w->pos = 0;
+}
+
+static void reader_init(Reader *r, const Message *message)
+{
+  r->message = message;
+  r->pos = 0;
+  r->error = 0;
+}
+
+int message_session_id(const Message *message)
+{
+  switch (message->message_type)
+  {
+  case GAME_GUESS:
+  case GAME_END:
+  case GAME_GET_TARGET:
+  case GAME_UPDATE:
+  case GAME_TIMEOUT:
+  case GAME_HINT:
+  {
+    Reader r;
+    reader_init(&r, message);
+    int32_t session_id = read_i32(&r);
+    return r.error ? -1 : session_id;
+  }
+  default:
+    return -1;
+  }
+}
+
+void encode_session_request(Message *message, const SessionRequest *request)
+{
+  Writer w;
+  writer_init(&w, message);
+  write_i32(&w, request->session_id);
+  write_str(&w, request->player, WIRE_NAME_SIZE);
+  write_end(&w);
+}
+
+int decode_session_request(const Message *message, SessionRequest *request)
+{
+  Reader r;
+  reader_init(&r, message);
+  request->session_id = read_i32(&r);
+  read_str(&r, request->player, WIRE_NAME_SIZE);
+  return r.error ? -1 : 0;
+}
+
+void encode_guess_request(Message *message, const GuessRequest *request)
+{
+  Writer w;
+  writer_init(&w, message);
+  write_i32(&w, request->session_id);
+  write_str(&w, request->player, WIRE_NAME_SIZE);
+  write_str(&w, request->word, WIRE_WORD_SIZE);
+  write_end(&w);
+}
+
+int decode_guess_request(const Message *message, GuessRequest *request)
+{
+  Reader r;
+  reader_init(&r, message);
+  request->session_id = read_i32(&r);
+  read_str(&r, request->player, WIRE_NAME_SIZE);
+  read_str(&r, request->word, WIRE_WORD_SIZE);
+  return r.error ? -1 : 0;
+}
+
+void encode_hint_request(Message *message, const HintRequest *request)
+{
+  Writer w;
+  writer_init(&w, message);
+  write_i32(&w, request->session_id);
+  write_str(&w, request->player, WIRE_NAME_SIZE);
+  write_u8(&w, request->count);
+  write_end(&w);
+}
+
+int decode_hint_request(const Message *message, HintRequest *request)
+{
+  Reader r;
+  reader_init(&r, message);
+  request->session_id = read_i32(&r);
+  read_str(&r, request->player, WIRE_NAME_SIZE);
+  request->count = (uint8_t)read_u8(&r);
+  return r.error ? -1 : 0;
+}
+
+void encode_start_request(Message *message, const StartRequest *request)
+{
+  Writer w;
+  writer_init(&w, message);
+  write_str(&w, request->player1, WIRE_NAME_SIZE);
+  write_str(&w, request->player2, WIRE_NAME_SIZE);
+  write_u8(&w, request->word_length);
+  write_end(&w);
+}
+
+int decode_start_request(const Message *message, StartRequest *request)
+{
+  Reader r;
+  reader_init(&r, message);
+  read_str(&r, request->player1, WIRE_NAME_SIZE);
+  read_str(&r, request->player2, WIRE_NAME_SIZE);
+  request->word_length = (uint8_t)read_u8(&r);
+  return r.error ? -1 : 0;
+}
+
+void encode_start_reply(Message *message, const StartReply *reply)
+{
+  Writer w;
+  writer_init(&w, message);
+  write_i32(&w, reply->session_id);
+  write_u8(&w, reply->player_num);
+  write_end(&w);
+}
+
+int decode_start_reply(const Message *message, StartReply *reply)
+{
+  Reader r;
+  reader_init(&r, message);
+  reply->session_id = read_i32(&r);
+  reply->player_num = (uint8_t)read_u8(&r);
+  return r.error ? -1 : 0;
+}
+
+void encode_guess_reply(Message *message, const GuessReply *reply)
+{
+  Writer w;
+  writer_init(&w, message);
+  write_u8(&w, reply->outcome);
+  if (reply->outcome == GUESS_TIMEOUT_LOSE)
+  {
+    write_str(&w, reply->player, WIRE_NAME_SIZE);
+  }
+  else
+  {
+    write_u8(&w, reply->next_player);
+    write_str(&w, reply->word, WIRE_WORD_SIZE);
+    write_i32(&w, reply->player1_score);
+    write_i32(&w, reply->player2_score);
+  }
+  write_end(&w);
+}
+
+int decode_guess_reply(const Message *message, GuessReply *reply)
+{
+  Reader r;
+  reader_init(&r, message);
+  memset(reply, 0, sizeof(*reply));
+  reply->outcome = (uint8_t)read_u8(&r);
+  if (reply->outcome == GUESS_TIMEOUT_LOSE)
+  {
+    read_str(&r, reply->player, WIRE_NAME_SIZE);
+  }
+  else
+  {
+    reply->next_player = (uint8_t)read_u8(&r);
+    read_str(&r, reply->word, WIRE_WORD_SIZE);
+    reply->player1_score = read_i32(&r);
+    reply->player2_score = read_i32(&r);
+  }
+  return r.error ? -1 : 0;
+}
+
+void encode_hint_reply(Message *message, const HintReply *reply)
+{
+  Writer w;
+  writer_init(&w, message);
+  int count = reply->count < WIRE_MAX_HINTS ? reply->count : WIRE_MAX_HINTS;
+  write_u8(&w, (unsigned)count);
+  for (int i = 0; i < count; i++)
+  {
+    write_str(&w, reply->words[i], WIRE_WORD_SIZE);
+    write_u16(&w, reply->scores[i]);
+  }
+  write_end(&w);
+}
+
+int decode_hint_reply(const Message *message, HintReply *reply)
+{
+  Reader r;
+  reader_init(&r, message);
+  reply->count = (uint8_t)read_u8(&r);
+  if (reply->count > WIRE_MAX_HINTS)
+    return -1;
+  for (int i = 0; i < reply->count; i++)
+  {
+    read_str(&r, reply->words[i], WIRE_WORD_SIZE);
+    reply->scores[i] = (uint16_t)read_u16(&r);
+  }
+  return r.error ? -1 : 0;
+}
+
+void encode_score_update(Message *message, const ScoreUpdate *update)
+{
+  Writer w;
+  writer_init(&w, message);
+  write_str(&w, update->player1, WIRE_NAME_SIZE);
+  write_i32(&w, update->player1_score);
+  write_str(&w, update->player2, WIRE_NAME_SIZE);
+  write_i32(&w, update->player2_score);
+  write_end(&w);
+}
+
+int decode_score_update(const Message *message, ScoreUpdate *update)
+{
+  Reader r;
+  reader_init(&r, message);
+  read_str(&r, update->player1, WIRE_NAME_SIZE);
+  update->player1_score = read_i32(&r);
+  read_str(&r, update->player2, WIRE_NAME_SIZE);
+  update->player2_score = read_i32(&r);
+  return r.error ? -1 : 0;
+}
+
+void encode_end_notice(Message *message, const EndNotice *notice)
+{
+  Writer w;
+  writer_init(&w, message);
+  write_u8(&w, notice->reason);
+  write_str(&w, notice->player, WIRE_NAME_SIZE);
+  write_i32(&w, notice->score_change);
+  write_end(&w);
+}
+
+int decode_end_notice(const Message *message, EndNotice *notice)
+{
+  Reader r;
+  reader_init(&r, message);
+  notice->reason = (uint8_t)read_u8(&r);
+  read_str(&r, notice->player, WIRE_NAME_SIZE);
+  notice->score_change = read_i32(&r);
+  return r.error ? -1 : 0;
+}
+
+void encode_turn(Message *message, int player_num)
+{
+  Writer w;
+  writer_init(&w, message);
+  write_u8(&w, (unsigned)player_num);
+  write_end(&w);
+}
+
+int decode_turn(const Message *message, int *player_num)
+{
+  Reader r;
+  reader_init(&r, message);
+  *player_num = (int)read_u8(&r);
+  return r.error ? -1 : 0;
+}
+
+void encode_word(Message *message, const char *word)
+{
+  Writer w;
+  writer_init(&w, message);
+  write_str(&w, word, WIRE_WORD_SIZE);
+  write_end(&w);
+}
+
+int decode_word(const Message *message, char *word, size_t size)
+{
+  Reader r;
+  reader_init(&r, message);
+  read_str(&r, word, size);
+  return r.error ? -1 : 0;
+}
@@ -1,6 +1,7 @@
 #ifndef __MESSAGE__
 #define __MESSAGE__
 
+#include <stddef.h>
 #include <stdint.h>
 #define BUFFER_SIZE 1024
 
@@ -26,6 +27,8 @@ enum MessageType
   GAME_DETAIL_REQUEST = 18,
   GET_SCORE_BY_USER_REQUEST = 19,
   GAME_TIMEOUT = 20,
+  GAME_HINT = 21,
+  SERVER_BUSY = 22, // Sent, with status SERVICE_UNAVAILABLE, to a connection refused on accept
 };
 
 enum StatusCode
@@ -46,7 +49,151 @@ typedef struct
 {
   enum MessageType message_type;
   enum StatusCode status;
+  uint16_t length; // Bytes used in payload; only read for binary messages (see below)
   char payload[BUFFER_SIZE];
 } Message;
 
+// Wire format: a 6-byte header (type, status, payload length; 16-bit big
+// endian each) followed by only the used payload bytes, without the NUL.
+#define MESSAGE_HEADER_SIZE 6
+#define MESSAGE_MAX_FRAME (MESSAGE_HEADER_SIZE + BUFFER_SIZE)
+
+// Write message as one frame into frame (MESSAGE_MAX_FRAME bytes); returns its
+// size. Text payloads are sent up to their NUL, binary ones up to length.
+size_t message_encode(const Message *message, char *frame);
+// Read one frame from the start of data. Returns the bytes it took, 0 if data
+// holds only part of a frame, -1 if the header is invalid (too long, or a text
+// payload of BUFFER_SIZE bytes that would leave no room for its NUL).
+int message_decode(const char *data, size_t len, Message *message);
+
+/* Binary game payloads */
+
+// In-game messages (message_is_binary) carry fixed-width big-endian integers
+// and strings prefixed by a one-byte length instead of '|'-separated text, so
+// they are built and read without sprintf/sscanf. The encoders below fill in
+// payload and length; the caller sets message_type and status. A reply whose
+// status is not SUCCESS carries the reason as plain text (message_set_text).
+#define WIRE_NAME_SIZE 50 // Player names, NUL included
+#define WIRE_WORD_SIZE 50 // Words as typed; the server checks the length
+#define WIRE_MAX_HINTS 10
+
+// GAME_GET_TARGET, GAME_UPDATE, GAME_END, GAME_TIMEOUT requests
+typedef struct
+{
+  int32_t session_id;
+  char player[WIRE_NAME_SIZE];
+} SessionRequest;
+
+// GAME_GUESS request
+typedef struct
+{
+  int32_t session_id;
+  char player[WIRE_NAME_SIZE];
+  char word[WIRE_WORD_SIZE];
+} GuessRequest;
+
+// GAME_HINT request
+typedef struct
+{
+  int32_t session_id;
+  char player[WIRE_NAME_SIZE];
+  uint8_t count;
+} HintRequest;
+
+// GAME_START request; word_length 0 lets the server pick
+typedef struct
+{
+  char player1[WIRE_NAME_SIZE];
+  char player2[WIRE_NAME_SIZE];
+  uint8_t word_length;
+} StartRequest;
+
+// GAME_START reply
+typedef struct
+{
+  int32_t session_id;
+  uint8_t player_num;
+} StartReply;
+
+enum GuessOutcome
+{
+  GUESS_CONTINUE = 0,     // word was accepted, next_player moves next
+  GUESS_TIMEOUT_LOSE = 1, // player ran out of time
+};
+
+// GAME_GUESS reply, sent to both players
+typedef struct
+{
+  uint8_t outcome;
+  uint8_t next_player;
+  char word[WIRE_WORD_SIZE];
+  int32_t player1_score;
+  int32_t player2_score;
+  char player[WIRE_NAME_SIZE]; // GUESS_TIMEOUT_LOSE: who lost
+} GuessReply;
+
+// GAME_HINT reply: best replies, score = words the opponent could still answer with
+typedef struct
+{
+  uint8_t count;
+  char words[WIRE_MAX_HINTS][WIRE_WORD_SIZE];
+  uint16_t scores[WIRE_MAX_HINTS];
+} HintReply;
+
+// GAME_SCORE
+typedef struct
+{
+  char player1[WIRE_NAME_SIZE];
+  int32_t player1_score;
+  char player2[WIRE_NAME_SIZE];
+  int32_t player2_score;
+} ScoreUpdate;
+
+enum EndReason
+{
+  END_RESULT = 0,    // player won and score_change points moved
+  END_ABANDONED = 1, // player left the game
+  END_SHUTDOWN = 2,  // Server restarting; the game was saved unfinished, no points moved
+};
+
+// GAME_END notice
+typedef struct
+{
+  uint8_t reason;
+  char player[WIRE_NAME_SIZE];
+  int32_t score_change;
+} EndNotice;
+
+int message_is_binary(enum MessageType type);
+// Session id of a session-scoped binary request, -1 if it has none
+int message_session_id(const Message *message);
+// Plain text payload (error replies of binary messages, and every text message)
+void message_set_text(Message *message, enum StatusCode status, const char *text);
+
+// Encoders cannot fail: every field fits BUFFER_SIZE. Decoders return 0, or -1
+// if the payload is short or a string does not fit its field.
+void encode_session_request(Message *message, const SessionRequest *request);
+int decode_session_request(const Message *message, SessionRequest *request);
+void encode_guess_request(Message *message, const GuessRequest *request);
+int decode_guess_request(const Message *message, GuessRequest *request);
+void encode_hint_request(Message *message, const HintRequest *request);
+int decode_hint_request(const Message *message, HintRequest *request);
+void encode_start_request(Message *message, const StartRequest *request);
+int decode_start_request(const Message *message, StartRequest *request);
+void encode_start_reply(Message *message, const StartReply *reply);
+int decode_start_reply(const Message *message, StartReply *reply);
+void encode_guess_reply(Message *message, const GuessReply *reply);
+int decode_guess_reply(const Message *message, GuessReply *reply);
+void encode_hint_reply(Message *message, const HintReply *reply);
+int decode_hint_reply(const Message *message, HintReply *reply);
+void encode_score_update(Message *message, const ScoreUpdate *update);
+int decode_score_update(const Message *message, ScoreUpdate *update);
+void encode_end_notice(Message *message, const EndNotice *notice);
+int decode_end_notice(const Message *message, EndNotice *notice);
+// GAME_TURN and GAME_GET_TARGET replies: a single player number / word
+void encode_turn(Message *message, int player_num);
+int decode_turn(const Message *message, int *player_num);
+void encode_word(Message *message, const char *word);
+int decode_word(const Message *message, char *word, size_t size);
+
 #endif
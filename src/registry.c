@@ -0,0 +1,212 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "registry.h"
+
+typedef struct
+{
+  char name[MAX_USERNAME_LEN];
+  int refs;   // 0: free
+  int player; // Index into players while logged in, -1 otherwise
+} Name;
+
+static Name *names;          // Indexed by id, names[0] unused
+static uint32_t *buckets;    // Id, 0 if empty
+static uint32_t bucket_mask; // Bucket count - 1, a power of two at least twice the ids
+static uint32_t *free_ids;
+static int free_count;
+
+static PlayerInfo *players;
+static int capacity;
+static int count;
+static int *by_fd; // fd -> index into players, -1 if none
+static int fd_limit;
+
+static uint32_t hash_name(const char *name)
+{
+  uint32_t h = 2166136261u; // FNV-1a
+  for (const char *c = name; *c; c++)
+    h = (h ^ (unsigned char)*c) * 16777619u;
+  return h;
+}
+
+// Bucket holding name, or the empty bucket where it would go
+static int find_bucket(const char *name)
+{
+  int b = hash_name(name) & bucket_mask;
+  while (buckets[b] != 0 && strcmp(names[buckets[b]].name, name) != 0)
+    b = (b + 1) & bucket_mask;
+  return b;
+}
+
+// Empty bucket b and pull later entries of its probe run back over it, so no
+// lookup ever stops early at the hole
+static void clear_bucket(int b)
+{
+  int hole = b;
+  for (int next = (b + 1) & bucket_mask; buckets[next] != 0; next = (next + 1) & bucket_mask)
+  {
+    int home = hash_name(names[buckets[next]].name) & bucket_mask;
+    // Movable unless its home lies cyclically in (hole, next]
+    if (((next - home) & bucket_mask) >= ((next - hole) & bucket_mask))
+    {
+      buckets[hole] = buckets[next];
+      hole = next;
+    }
+  }
+  buckets[hole] = 0;
+}
+
+int registry_init(int max_fds, int max_players, int max_ids)
+{
+  uint32_t buckets_count = 2;
+  while (buckets_count < 2 * (uint32_t)max_ids)
+    buckets_count *= 2;
+  by_fd = malloc(sizeof(int) * max_fds);
+  players = calloc(max_players, sizeof(PlayerInfo));
+  names = calloc(max_ids + 1, sizeof(Name)); // Ids 1..max_ids
+  free_ids = malloc(sizeof(uint32_t) * max_ids);
+  buckets = calloc(buckets_count, sizeof(uint32_t));
+  if (by_fd == NULL || players == NULL || names == NULL || free_ids == NULL || buckets == NULL)
+  {
+    free(by_fd);
+    free(players);
+    free(names);
+    free(free_ids);
+    free(buckets);
+    return -1;
+  }
+  for (int fd = 0; fd < max_fds; fd++)
+    by_fd[fd] = -1;
+  fd_limit = max_fds;
+  capacity = max_players;
+  bucket_mask = buckets_count - 1;
+  // Hand out low ids first
+  free_count = 0;
+  for (int id = max_ids; id > 0; id--)
+    free_ids[free_count++] = id;
+  count = 0;
+  return 0;
+}
+
+int registry_capacity(void)
+{
+  return capacity;
+}
+
+/*****************************IDS*************************************/
+
+uint32_t registry_intern(const char *name)
+{
+  if (strlen(name) >= MAX_USERNAME_LEN)
+    return 0;
+  int b = find_bucket(name);
+  if (buckets[b] != 0)
+  {
+    names[buckets[b]].refs++;
+    return buckets[b];
+  }
+  if (free_count == 0)
+    return 0;
+
+  uint32_t id = free_ids[--free_count];
+  strcpy(names[id].name, name);
+  names[id].refs = 1;
+  names[id].player = -1;
+  buckets[b] = id;
+  return id;
+}
+
+uint32_t registry_lookup(const char *name)
+{
+  return buckets[find_bucket(name)];
+}
+
+void registry_hold(uint32_t id)
+{
+  names[id].refs++;
+}
+
+void registry_release(uint32_t id)
+{
+  if (id == 0 || --names[id].refs > 0)
+    return;
+  clear_bucket(find_bucket(names[id].name));
+  memset(&names[id], 0, sizeof(Name));
+  free_ids[free_count++] = id;
+}
+
+const char *registry_name(uint32_t id)
+{
+  return names[id].name;
+}
+
+/*****************************PLAYERS*************************************/
+
+PlayerInfo *registry_add(const char *name, int sock)
+{
+  if (count >= capacity || sock < 0 || sock >= fd_limit || by_fd[sock] >= 0)
+    return NULL;
+  uint32_t id = registry_lookup(name);
+  if (id != 0 && names[id].player >= 0)
+    return NULL;
+  id = registry_intern(name);
+  if (id == 0)
+    return NULL;
+
+  PlayerInfo *player = &players[count];
+  player->player_id = id;
+  player->player_sock = sock;
+  player->session_id = -1;
+  names[id].player = count;
+  by_fd[sock] = count;
+  count++;
+  return player;
+}
+
+PlayerInfo *registry_find(const char *name)
+{
+  return registry_find_id(registry_lookup(name));
+}
+
+PlayerInfo *registry_find_id(uint32_t id)
+{
+  if (id == 0 || names[id].refs == 0 || names[id].player < 0)
+    return NULL;
+  return &players[names[id].player];
+}
+
+PlayerInfo *registry_find_sock(int sock)
+{
+  if (sock < 0 || sock >= fd_limit || by_fd[sock] < 0)
+    return NULL;
+  return &players[by_fd[sock]];
+}
+
+void registry_remove(PlayerInfo *player)
+{
+  int index = (int)(player - players);
+  uint32_t id = player->player_id;
+  names[id].player = -1;
+  by_fd[player->player_sock] = -1;
+
+  int last = --count;
+  if (index != last)
+  {
+    players[index] = players[last];
+    names[players[index].player_id].player = index;
+    by_fd[players[index].player_sock] = index;
+  }
+  memset(&players[last], 0, sizeof(PlayerInfo));
+  registry_release(id);
+}
+
+PlayerInfo *registry_players(void)
+{
+  return players;
+}
+
+int registry_count(void)
+{
+  return count;
+}
@@ -0,0 +1,49 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include "database.h"
+
+// Player names and the players logged in on this server.
+//
+// Every name in use is interned to a small player id (1..max_ids, 0 = none)
+// so sessions hold and compare ids instead of names. An id lives
+// while someone holds a reference to it: the logged-in entry and each session
+// the player is in. Names sit in an open-addressing hash (linear probing,
+// deletion by backward shift) and logged-in entries are packed in one array,
+// also reachable from a table indexed by socket fd. Interning, add, lookups
+// and removal are all O(1).
+//
+// Not thread-safe: the caller holds its own lock around every call, except
+// registry_name for an id it holds a reference to.
+
+// Call once before any other function; fds from 0 to max_fds - 1 can be used.
+// Up to max_players are logged in at once (one per connection, so the
+// connection limit) and up to max_ids names are in use, logged in or held by
+// a session. Returns 0, or -1 if the tables cannot be allocated.
+int registry_init(int max_fds, int max_players, int max_ids);
+int registry_capacity(void); // max_players
+
+// The id of name with one more reference, or 0 when out of ids
+uint32_t registry_intern(const char *name);
+// The id of name (no reference taken), or 0 if nobody holds it
+uint32_t registry_lookup(const char *name);
+void registry_hold(uint32_t id);
+// Drop a reference; the id may be reused once none is left
+void registry_release(uint32_t id);
+// Stays valid while the caller holds a reference to id
+const char *registry_name(uint32_t id);
+
+// The new entry (session_id -1, holding a reference to its player_id), or
+// NULL when max_players are logged in, when name is already logged in, or
+// when sock already belongs to a player (one per connection)
+PlayerInfo *registry_add(const char *name, int sock);
+PlayerInfo *registry_find(const char *name);
+PlayerInfo *registry_find_id(uint32_t id);
+PlayerInfo *registry_find_sock(int sock);
+// Moves the last entry into the hole: pointers from earlier calls go stale
+void registry_remove(PlayerInfo *player);
+// All entries, registry_count() of them, in no particular order
+PlayerInfo *registry_players(void);
+int registry_count(void);
+
+#endif
@@ -1,34 +1,115 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <signal.h>
 #include <errno.h>
-#include <sys/select.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/un.h>
 #include <sqlite3.h>
 #include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "database.h"
+#include "dictionary.h"
+#include "event_loop.h"
+#include "admission.h"
+#include "handoff.h"
+#include "registry.h"
 #include "./model/message.h"
 
 #define PORT 8080
-#define MAX_CLIENTS 30
 #define BUFFER_SIZE 1024
-#define MAX_PLAYERS 100
-#define MAX_SESSIONS 15
+#define MAX_SESSIONS 1024 // Chia đều cho các shard: session i thuộc shard i % shard_count
+#define NO_DICTIONARY (-2) // create_game_session: không có từ điển cho độ dài từ đó
+#define MAX_SHARDS 64
+#define MAX_CONNECTIONS (1 << 20) // Trần bảng kết nối, thực tế theo RLIMIT_NOFILE
 #define DB_FILE "database.db"
-
-volatile sig_atomic_t got_signal = 0;
-sqlite3 *db;
+#define SUGGEST_COUNT 3
+#define SUGGEST_MAX_DISTANCE 2
+#define SUGGEST_BUDGET_NS 50000 // Chạy trên luồng event loop nên giới hạn ~50us
+#define DEFAULT_HINTS 3
+#define MAX_HINTS 10
+#define TURN_TIMEOUT_MS 12000        // Client đếm 10s, dư 2s cho độ trễ mạng
+#define FIRST_TURN_TIMEOUT_MS 60000  // Lượt đầu client không tính giờ, chỉ để session không treo mãi
+#define CONNECTION_FD_RESERVE 64     // fd để dành cho database, signalfd, listen socket...
+#define DEFAULT_RETRY_AFTER_MS 1000
+#define DEFAULT_DRAIN_TIMEOUT_MS 60000 // SIGINT: chờ tối đa chừng này cho các ván đang chơi
+#define DRAIN_CHECK_MS 250
+#define DRAIN_FLUSH_MS 200 // Để thông báo cuối cùng kịp gửi trước khi đóng kết nối
+#define DEFAULT_PRESENCE_FLUSH_MS 2000 // Ghi isOnline xuống database theo lô; 0 = không ghi
+#define DB_BUSY_TIMEOUT_MS 2000 // Hai kết nối database chờ nhau thay vì trả SQLITE_BUSY
+#define UPGRADE_ACK_TIMEOUT_S 10 // Tiến trình mới không xác nhận kịp thì tiến trình cũ chạy tiếp
+#define BENCH_PAIRS 32               // Bot của --bench, mỗi bot chiếm một chỗ trong registry
+#define BENCH_GAME_MOVES 200         // Sau chừng này nước bot bỏ ván (không ghi DB) và mở ván mới
+
+sqlite3 *db; // Mở ở chế độ serialized nên mọi shard dùng chung được
+// Kết nối riêng cho ghi presence: transaction của nó không được lẫn câu lệnh
+// các shard khác chạy trên db
+sqlite3 *presence_db;
+
+// Mỗi shard là một luồng với listen socket (SO_REUSEPORT) và event loop riêng.
+// Session chỉ được đọc/ghi trên shard sở hữu nó; message của session nhận ở
+// shard khác được chuyển qua mailbox (xem route_message).
+int shard_count = 1;
+EventLoop shards[MAX_SHARDS];
 
 GameSession game_sessions[MAX_SESSIONS];
-
-PlayerInfo player_list[MAX_PLAYERS]; // Array to store player information
-int player_count = 0;                // Current number of players
+Timer turn_timers[MAX_SESSIONS]; // Hạn lượt hiện tại của session i, chạy trên shard sở hữu session
+void turn_timer_expired(Timer *timer);
+
+// Dừng êm: SIGINT đầu tiên ngừng nhận kết nối và ván mới, chờ các ván đang
+// chơi kết thúc (tối đa drain_timeout_ms). Ván còn dang dở được báo cho người
+// chơi rồi lưu vào lịch sử trong một transaction trước khi thoát.
+atomic_int draining;
+int drain_timeout_ms = DEFAULT_DRAIN_TIMEOUT_MS;
+int drain_checks_left;
+int drain_finishing;
+Timer drain_timer; // Chạy trên shard 0
+
+// Nâng cấp binary không ngắt kết nối (SIGUSR2, xem UPGRADE)
+atomic_int upgrade_requested;
+int upgrade_fd = -1;                  // Tiến trình mới: socket nhận trạng thái từ tiến trình cũ
+long restored_turn_ms[MAX_SESSIONS];  // Tiến trình mới: thời gian còn lại của lượt hiện tại
+
+const char *local_path;   // --unix: đường dẫn socket AF_UNIX, NULL nếu không dùng
+int local_listener = -1;  // Socket đó (của shard 0; các shard khác dùng bản dup)
+int bench_moves;          // --bench: số nước bot cần đi, 0 = không chạy benchmark
+
+// Người chơi đã đăng nhập: registry.c, tra theo tên hoặc theo socket
+pthread_mutex_t players_lock = PTHREAD_MUTEX_INITIALIZER; // Bảo vệ registry
+
+// Trạng thái online nằm trong registry; cột isOnline chỉ được ghi sau theo lô
+int presence_flush_ms = DEFAULT_PRESENCE_FLUSH_MS;
+atomic_int presence_dirty; // Registry đã đổi từ lần ghi trước
+Timer presence_timer;      // Chạy trên shard 0
 
 // --- SỬA ĐỔI: CHỈ DÙNG 1 DANH SÁCH TỪ ---
-char valid_words[MAX_WORDS][WORD_LENGTH + 1];
-int word_count = 0;
+// Từ 5 chữ dùng valid_words.txt/.bin (bắt buộc), độ dài N khác dùng
+// valid_wordsN.txt/.bin nếu có
+#define WORDS_TEXT_FILE "valid_words.txt"
+#define WORDS_INDEX_FILE "valid_words.bin" // Sinh bởi ./wordc
+
+// Một bộ từ điển theo độ dài từ, NULL nếu không có danh sách cho độ dài đó
+typedef struct
+{
+  Dictionary *by_length[MAX_WORD_LENGTH + 1];
+} DictionarySet;
+
+// Thế hệ từ điển hiện tại, session mới sẽ giữ một tham chiếu tới nó.
+// Luồng nạp lại đặt bộ mới vào pending_dictionaries và báo qua reload_pipe,
+// vòng lặp chính đổi con trỏ giữa hai lần xử lý message.
+Dictionary *current_dictionaries[MAX_WORD_LENGTH + 1];
+pthread_mutex_t dictionary_lock = PTHREAD_MUTEX_INITIALIZER; // Đổi thế hệ vs. session mới ở shard khác
+_Atomic(DictionarySet *) pending_dictionaries;
+atomic_int reload_in_progress;
+int reload_pipe[2] = {-1, -1};
+int dictionary_generation = 0;
 
 /****************************Word Function*******************************/
 
@@ -46,12 +127,15 @@ void scramble_string(char *str)
 }
 
 // Lấy từ ngẫu nhiên từ danh sách duy nhất
-char *get_random_word()
+void get_random_word(char *word)
 {
-  if (word_count == 0)
-    return "apple"; // Fallback nếu chưa load
-  int index = rand() % word_count;
-  return valid_words[index];
+  const Dictionary *dict = current_dictionaries[WORD_LENGTH];
+  if (dict == NULL || dict->count == 0)
+  {
+    strcpy(word, "apple"); // Fallback nếu chưa load
+    return;
+  }
+  dict_unpack(dict, dict->keys[rand() % dict->count], word);
 }
 
 void check_guess(const char *guess, const char *target, char *result)
@@ -66,70 +150,192 @@ void check_guess(const char *guess, const char *target, char *result)
   }
 }
 
-// Hàm load từ chung
-int load_words(const char *filename, char words[][WORD_LENGTH + 1])
+// Nạp từ điển cho mọi độ dài hỗ trợ. Ưu tiên map file index đã biên dịch,
+// nếu không có thì đọc file text. Trả về -1 nếu thiếu từ điển mặc định.
+int load_dictionaries(DictionarySet *set)
 {
-  FILE *file = fopen(filename, "r");
-  if (file == NULL)
+  memset(set, 0, sizeof(DictionarySet));
+  for (int length = MIN_WORD_LENGTH; length <= MAX_WORD_LENGTH; length++)
   {
-    perror("Error opening file");
-    return -1;
+    char index_file[64], text_file[64];
+    if (length == WORD_LENGTH)
+    {
+      strcpy(index_file, WORDS_INDEX_FILE);
+      strcpy(text_file, WORDS_TEXT_FILE);
+    }
+    else
+    {
+      sprintf(index_file, "valid_words%d.bin", length);
+      sprintf(text_file, "valid_words%d.txt", length);
+      if (access(index_file, R_OK) != 0 && access(text_file, R_OK) != 0)
+        continue; // Độ dài này không bật
+    }
+    set->by_length[length] = dict_create(index_file, text_file, length);
   }
-  int count = 0;
-  while (fscanf(file, "%5s", words[count]) == 1)
+
+  if (set->by_length[WORD_LENGTH] == NULL)
   {
-    count++;
-    if (count >= MAX_WORDS)
-      break;
+    for (int length = 0; length <= MAX_WORD_LENGTH; length++)
+      dict_release(set->by_length[length]);
+    return -1;
   }
-  fclose(file);
-  return count;
+  return 0;
 }
 
-// SỬA ĐỔI: Chỉ load valid_words.txt
 void init_wordle()
 {
   srand(time(NULL));
 
-  word_count = load_words("valid_words.txt", valid_words);
-  printf("Loaded %d words from valid_words.txt\n", word_count);
-
-  if (word_count == -1 || word_count == 0)
+  DictionarySet set;
+  if (load_dictionaries(&set) < 0)
   {
     printf("Failed to load word list or list is empty.\n");
     exit(1);
   }
+  dictionary_generation++;
+  for (int length = 0; length <= MAX_WORD_LENGTH; length++)
+  {
+    current_dictionaries[length] = set.by_length[length];
+    if (set.by_length[length] != NULL)
+      set.by_length[length]->generation = dictionary_generation;
+  }
+
+  if (pipe(reload_pipe) < 0)
+  {
+    perror("pipe");
+    exit(1);
+  }
+  fcntl(reload_pipe[0], F_SETFL, O_NONBLOCK);
+}
+
+// Chạy trên luồng riêng để không chặn vòng lặp chính khi nạp lại
+void *dictionary_reload_thread(void *arg)
+{
+  DictionarySet *set = malloc(sizeof(DictionarySet));
+  if (set == NULL || load_dictionaries(set) < 0)
+  {
+    printf("Dictionary reload failed, keeping generation %d\n", dictionary_generation);
+    free(set);
+    atomic_store(&reload_in_progress, 0);
+    return NULL;
+  }
+  atomic_store(&pending_dictionaries, set);
+  write(reload_pipe[1], "R", 1);
+  return NULL;
+}
+
+void start_dictionary_reload()
+{
+  if (atomic_exchange(&reload_in_progress, 1))
+  {
+    printf("Dictionary reload already running\n");
+    return;
+  }
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, dictionary_reload_thread, NULL) != 0)
+  {
+    perror("pthread_create");
+    atomic_store(&reload_in_progress, 0);
+    return;
+  }
+  pthread_detach(thread);
 }
 
-// SỬA ĐỔI: Chỉ kiểm tra trong valid_words
-int is_valid_guess(const char *guess)
+// Gọi từ vòng lặp chính khi reload_pipe đọc được: không có handler nào đang
+// chạy nên có thể đổi thế hệ ngay. Session cũ vẫn giữ thế hệ cũ tới khi kết thúc.
+void publish_pending_dictionary()
 {
-  for (int i = 0; i < word_count; i++)
+  char buf[16];
+  while (read(reload_pipe[0], buf, sizeof(buf)) > 0)
+    ;
+
+  DictionarySet *set = atomic_exchange(&pending_dictionaries, NULL);
+  if (set == NULL)
+    return;
+
+  dictionary_generation++;
+  for (int length = 0; length <= MAX_WORD_LENGTH; length++)
   {
-    if (strcmp(guess, valid_words[i]) == 0)
+    pthread_mutex_lock(&dictionary_lock);
+    Dictionary *old = current_dictionaries[length];
+    Dictionary *dict = set->by_length[length];
+    current_dictionaries[length] = dict;
+    pthread_mutex_unlock(&dictionary_lock);
+    if (dict != NULL)
     {
-      return 1; // Hợp lệ
+      dict->generation = dictionary_generation;
+      printf("Dictionary generation %d active (%d %d-letter words)\n", dict->generation, dict->count, length);
     }
+    dict_release(old);
+  }
+  free(set);
+  atomic_store(&reload_in_progress, 0);
+}
+
+// Tra cứu O(1) trong bảng băm, trả về chỉ số từ trong từ điển hoặc -1
+int is_valid_guess(const Dictionary *dict, uint32_t guess_key)
+{
+  return dict_index_of_key(dict, guess_key);
+}
+
+// Gợi ý "Did you mean" cho từ không có trong từ điển: các từ gần nhất
+// (khác ít chữ nhất) chưa dùng và đúng luật nối từ của session
+void format_suggestions(const GameSession *session, const char *guess, char *out, size_t size)
+{
+  out[0] = '\0';
+  const Dictionary *dict = session->dictionary;
+  int length = dict_word_length(dict);
+  char lower[MAX_WORD_LENGTH + 1];
+  if (strlen(guess) != (size_t)length)
+    return;
+  for (int i = 0; i <= length; i++)
+    lower[i] = tolower((unsigned char)guess[i]);
+
+  uint32_t key = dict_pack(dict, lower);
+  if (key == 0)
+    return;
+
+  int first_letter = session->current_attempts > 0 ? word_key_last(session->last_key) : -1;
+  uint32_t found[SUGGEST_COUNT];
+  int count = dict_suggest(dict, key, first_letter, session->used_words,
+                           SUGGEST_MAX_DISTANCE, SUGGEST_BUDGET_NS, found, SUGGEST_COUNT);
+  if (count == 0)
+    return;
+
+  size_t len = snprintf(out, size, "\nDid you mean: ");
+  for (int i = 0; i < count && len < size; i++)
+  {
+    char word[MAX_WORD_LENGTH + 1];
+    dict_unpack(dict, found[i], word);
+    len += snprintf(out + len, size - len, "%s%s", word, i + 1 < count ? ", " : "?");
   }
-  return 0; // Không tìm thấy
 }
 /***************************************************************************/
 
 /****************************Database Function*******************************/
 int open_database()
 {
-  int rc = sqlite3_open(DB_FILE, &db);
+  int rc = sqlite3_open_v2(DB_FILE, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX, NULL);
   if (rc)
   {
     fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
     return 1;
   }
+  rc = sqlite3_open_v2(DB_FILE, &presence_db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_FULLMUTEX, NULL);
+  if (rc)
+  {
+    fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(presence_db));
+    return 1;
+  }
+  sqlite3_busy_timeout(db, DB_BUSY_TIMEOUT_MS);
+  sqlite3_busy_timeout(presence_db, DB_BUSY_TIMEOUT_MS);
   printf("Database opened successfully\n");
   return 0;
 }
 
 void close_database()
 {
+  sqlite3_close(presence_db);
   sqlite3_close(db);
   printf("Database closed successfully\n");
 }
@@ -145,59 +351,157 @@ void get_time_as_string(char *buffer, size_t buffer_size)
   strftime(buffer, buffer_size, "%Y-%m-%d %H:%M:%S", time_info);
 }
 
+// Thêm số thứ tự để hai ván tạo trong cùng một giây không trùng mã
+// (game_id là khoá chính của game_history)
 void generate_game_id(char *game_id, size_t size)
 {
+  static atomic_uint sequence;
   time_t now = time(NULL);
-  snprintf(game_id, size, "GAME-%ld", now);
+  snprintf(game_id, size, "GAME-%ld-%03u", now, atomic_fetch_add(&sequence, 1) % 1000);
 }
 
 int add_player(const char *player_name, int player_sock)
 {
-  if (player_count >= MAX_PLAYERS)
+  pthread_mutex_lock(&players_lock);
+  PlayerInfo *player = registry_add(player_name, player_sock);
+  pthread_mutex_unlock(&players_lock);
+  if (player == NULL)
   {
-    printf("Player list is full!\n");
+    printf("Cannot add player %s: list full, already logged in or socket in use\n", player_name);
     return -1;
   }
-  for (int i = 0; i < player_count; i++)
-  {
-    if (strcmp(player_list[i].player_name, player_name) == 0)
-    {
-      printf("Player %s already exists!\n", player_name);
-      return -1;
-    }
-  }
-  strcpy(player_list[player_count].player_name, player_name);
-  player_list[player_count].player_sock = player_sock;
-  player_count++;
+  atomic_store(&presence_dirty, 1);
   return 0;
 }
 
 int get_player_sock(const char *player_name)
 {
-  for (int i = 0; i < player_count; i++)
-  {
-    if (strcmp(player_list[i].player_name, player_name) == 0)
-    {
-      return player_list[i].player_sock;
-    }
-  }
-  printf("Player %s not found!\n", player_name);
-  return -1;
+  pthread_mutex_lock(&players_lock);
+  PlayerInfo *player = registry_find(player_name);
+  int sock = player != NULL ? player->player_sock : -1;
+  pthread_mutex_unlock(&players_lock);
+  if (sock < 0)
+    printf("Player %s not found!\n", player_name);
+  return sock;
 }
 
-int create_game_session(const char *player1_name, const char *player2_name)
+// Gọi khi giữ players_lock: socket của người chơi id và generation của kết
+// nối đó (-1 nếu không đăng nhập). Registry bỏ người chơi trước khi kết nối
+// đóng, nên generation đọc lúc này đúng là kết nối của người đó
+int get_player_client(uint32_t player_id, unsigned *generation)
 {
-  for (int i = 0; i < MAX_SESSIONS; i++)
+  PlayerInfo *player = registry_find_id(player_id);
+  *generation = player != NULL ? event_loop_generation(player->player_sock) : 0;
+  return player != NULL ? player->player_sock : -1;
+}
+
+// Id của tên (không giữ tham chiếu), 0 nếu không ai dùng tên đó
+uint32_t lookup_player_id(const char *player_name)
+{
+  pthread_mutex_lock(&players_lock);
+  uint32_t id = registry_lookup(player_name);
+  pthread_mutex_unlock(&players_lock);
+  return id;
+}
+
+// Tên của id mà người gọi đang giữ tham chiếu (vd. của session), không cần khoá
+const char *player_id_name(uint32_t player_id)
+{
+  return registry_name(player_id);
+}
+
+// Session người chơi đang tham gia, -1 nếu không có
+int get_player_session(const char *player_name)
+{
+  pthread_mutex_lock(&players_lock);
+  PlayerInfo *player = registry_find(player_name);
+  int session_id = player != NULL ? player->session_id : -1;
+  pthread_mutex_unlock(&players_lock);
+  return session_id;
+}
+
+// Ghi session vào registry; chỉ đổi người đang ở session expected
+void set_player_session(uint32_t player_id, int expected, int session_id)
+{
+  pthread_mutex_lock(&players_lock);
+  PlayerInfo *player = registry_find_id(player_id);
+  if (player != NULL && player->session_id == expected)
+    player->session_id = session_id;
+  pthread_mutex_unlock(&players_lock);
+}
+
+// Shard đang chạy luồng hiện tại
+int current_shard()
+{
+  EventLoop *loop = event_loop_current();
+  return loop != NULL ? loop->index : 0;
+}
+
+int session_shard(int session_id)
+{
+  return session_id % shard_count;
+}
+
+// Hai người chơi luôn về cùng một shard, không phụ thuộc thứ tự tên
+int pair_shard(const char *player1_name, const char *player2_name)
+{
+  uint32_t h1 = 2166136261u, h2 = 2166136261u;
+  for (const char *c = player1_name; *c; c++)
+    h1 = (h1 ^ (unsigned char)*c) * 16777619u;
+  for (const char *c = player2_name; *c; c++)
+    h2 = (h2 ^ (unsigned char)*c) * 16777619u;
+  return (int)((h1 + h2) % (uint32_t)shard_count);
+}
+
+// Chỉ dùng các slot thuộc shard hiện tại. Trả về session id, -1 nếu hết slot
+// (hoặc hết id), NO_DICTIONARY nếu không có từ điển word_length chữ
+int create_game_session(const char *player1_name, const char *player2_name, int word_length)
+{
+  // SIGHUP có thể gỡ từ điển của một độ dài trên luồng khác: chỉ tin con trỏ lấy dưới khoá
+  pthread_mutex_lock(&dictionary_lock);
+  Dictionary *dict = dict_acquire(current_dictionaries[word_length]);
+  pthread_mutex_unlock(&dictionary_lock);
+  if (dict == NULL)
+    return NO_DICTIONARY;
+  if (!admission_acquire(ADMIT_SESSION))
+  {
+    dict_release(dict);
+    return -1;
+  }
+  for (int i = current_shard(); i < MAX_SESSIONS; i += shard_count)
   {
     if (!game_sessions[i].game_active)
     {
+      // Session giữ id của cả hai người chơi tới khi bị xóa
+      pthread_mutex_lock(&players_lock);
+      uint32_t player1_id = registry_intern(player1_name);
+      uint32_t player2_id = registry_intern(player2_name);
+      if (player1_id == 0 || player2_id == 0)
+      {
+        registry_release(player1_id);
+        registry_release(player2_id);
+        pthread_mutex_unlock(&players_lock);
+        break;
+      }
+      game_sessions[i].player1_sock = get_player_client(player1_id, &game_sessions[i].player1_generation);
+      game_sessions[i].player2_sock = get_player_client(player2_id, &game_sessions[i].player2_generation);
+      pthread_mutex_unlock(&players_lock);
+
       generate_game_id(game_sessions[i].game_id, sizeof(game_sessions[i].game_id));
-      strcpy(game_sessions[i].player1_name, player1_name);
-      strcpy(game_sessions[i].player2_name, player2_name);
+      game_sessions[i].player1_id = player1_id;
+      game_sessions[i].player2_id = player2_id;
 
       // --- LOGIC NỐI TỪ ---
       game_sessions[i].current_player = 1;
       memset(game_sessions[i].last_word, 0, sizeof(game_sessions[i].last_word));
+      game_sessions[i].last_key = 0;
+      memset(game_sessions[i].used_words, 0, sizeof(game_sessions[i].used_words));
+      game_sessions[i].word_length = word_length;
+      game_sessions[i].dictionary = dict;
+      for (int l = 0; l < ALPHABET_SIZE; l++)
+      {
+        game_sessions[i].remaining_by_letter[l] = dict_count_starting_with(dict, l);
+      }
 
       // Đặt bằng 0 để đánh dấu là lượt đầu tiên chưa tính giờ
       game_sessions[i].last_move_time = 0;
@@ -208,29 +512,46 @@ int create_game_session(const char *player1_name, const char *player2_name)
       game_sessions[i].game_active = 1;
       game_sessions[i].current_attempts = 0;
       get_time_as_string(game_sessions[i].start_time, sizeof(game_sessions[i].start_time));
+      turn_timers[i].callback = turn_timer_expired;
+      event_loop_timer_start(&turn_timers[i], FIRST_TURN_TIMEOUT_MS);
+      set_player_session(player1_id, -1, i);
+      set_player_session(player2_id, -1, i);
       return i;
     }
   }
+  dict_release(dict);
+  admission_release(ADMIT_SESSION); // Hết slot của shard này (hoặc hết id)
   return -1;
 }
 
 void clear_game_session(int session_id)
 {
   // Xóa sạch session
+  GameSession *session = &game_sessions[session_id];
+  event_loop_timer_cancel(&turn_timers[session_id]);
+  set_player_session(session->player1_id, session_id, -1);
+  set_player_session(session->player2_id, session_id, -1);
+  pthread_mutex_lock(&players_lock);
+  registry_release(session->player1_id);
+  registry_release(session->player2_id);
+  pthread_mutex_unlock(&players_lock);
+  dict_release(session->dictionary);
   memset(&game_sessions[session_id], 0, sizeof(GameSession));
+  admission_release(ADMIT_SESSION);
   printf("Cleared game session %d\n", session_id);
 }
 
 int find_existing_game(const char *player1_name, const char *player2_name)
 {
-  for (int i = 0; i < MAX_SESSIONS; i++)
+  uint32_t player1_id = lookup_player_id(player1_name), player2_id = lookup_player_id(player2_name);
+  if (player1_id == 0 || player2_id == 0)
+    return -1; // Tên chưa có trong session nào
+  for (int i = current_shard(); i < MAX_SESSIONS; i += shard_count)
   {
     if (game_sessions[i].game_active)
     {
-      if ((strcmp(game_sessions[i].player1_name, player1_name) == 0 &&
-           strcmp(game_sessions[i].player2_name, player2_name) == 0) ||
-          (strcmp(game_sessions[i].player1_name, player2_name) == 0 &&
-           strcmp(game_sessions[i].player2_name, player1_name) == 0))
+      if ((game_sessions[i].player1_id == player1_id && game_sessions[i].player2_id == player2_id) ||
+          (game_sessions[i].player1_id == player2_id && game_sessions[i].player2_id == player1_id))
       {
         return i;
       }
@@ -239,6 +560,69 @@ int find_existing_game(const char *player1_name, const char *player2_name)
   return -1;
 }
 
+// 1 hoặc 2 nếu player_name là người chơi của session, 0 nếu không. Session
+// giữ tham chiếu tới id của cả hai nên so tên không cần players_lock
+int session_player_num(const GameSession *session, const char *player_name)
+{
+  if (strcmp(player_id_name(session->player1_id), player_name) == 0)
+    return 1;
+  if (strcmp(player_id_name(session->player2_id), player_name) == 0)
+    return 2;
+  return 0;
+}
+
+// 1 hoặc 2 nếu client_sock là kết nối đã lưu của người chơi đó, 0 nếu không
+int session_client_num(const GameSession *session, int client_sock)
+{
+  unsigned generation = event_loop_generation(client_sock);
+  if (client_sock == session->player1_sock && generation == session->player1_generation)
+    return 1;
+  if (client_sock == session->player2_sock && generation == session->player2_generation)
+    return 2;
+  return 0;
+}
+
+// Người chơi (1 hoặc 2) mà message của client_sock nhân danh player_name:
+// tên phải là người chơi của session và client_sock là kết nối đã lưu của
+// chính người đó, nếu không trả 0
+int session_sender_num(const GameSession *session, const char *player_name, int client_sock)
+{
+  int num = session_player_num(session, player_name);
+  return num != 0 && session_client_num(session, client_sock) == num ? num : 0;
+}
+
+// Trên shard sở hữu session: người chơi num không còn dùng kết nối đã lưu
+void session_forget_client(GameSession *session, int num)
+{
+  if (num == 1)
+  {
+    session->player1_sock = -1;
+    session->player1_generation = 0;
+  }
+  else if (num == 2)
+  {
+    session->player2_sock = -1;
+    session->player2_generation = 0;
+  }
+}
+
+// Phần chung của bản ghi lịch sử: tên và các nước đi chỉ được dựng ở đây
+void fill_game_history(const GameSession *session, GameHistory *game_history)
+{
+  memset(game_history, 0, sizeof(GameHistory));
+  strcpy(game_history->game_id, session->game_id);
+  strcpy(game_history->player1, player_id_name(session->player1_id));
+  strcpy(game_history->player2, player_id_name(session->player2_id));
+  strcpy(game_history->start_time, session->start_time);
+  for (int i = 0; i < MAX_ATTEMPTS && i < session->current_attempts && i < MAX_TURNS; i++)
+  {
+    const SessionTurn *turn = &session->turns[i];
+    strcpy(game_history->moves[i].player_name, turn->player == 1 ? game_history->player1 : game_history->player2);
+    strcpy(game_history->moves[i].guess, turn->guess);
+    strcpy(game_history->moves[i].result, "VALID");
+  }
+}
+
 User *find_user_by_username(User users[], int size, const char *username)
 {
   for (int i = 0; i < size; i++)
@@ -251,246 +635,1435 @@ User *find_user_by_username(User users[], int size, const char *username)
   return NULL;
 }
 
+// Gửi cùng một message cho cả hai người chơi: mã hoá một lần, dùng chung frame
+void send_to_players(const GameSession *session, const Message *message)
+{
+  int socks[2] = {session->player1_sock, session->player2_sock};
+  unsigned generations[2] = {session->player1_generation, session->player2_generation};
+  broadcast_message(socks, generations, 2, message);
+}
+
 void send_score_update(GameSession *session)
 {
   Message message;
-  message.message_type = GAME_SCORE;
-  sprintf(message.payload, "%s|%d|%s|%d", session->player1_name, session->player1_score, session->player2_name, session->player2_score);
+  ScoreUpdate update;
+  strcpy(update.player1, player_id_name(session->player1_id));
+  update.player1_score = session->player1_score;
+  strcpy(update.player2, player_id_name(session->player2_id));
+  update.player2_score = session->player2_score;
+  message.message_type = GAME_SCORE;
+  message.status = SUCCESS;
+  encode_score_update(&message, &update);
+  printf("Sending score update to %s and %s\n", update.player1, update.player2);
+  send_to_players(session, &message);
+}
+
+// Kết thúc ván: người chơi loser_num (1 hoặc 2) thua vì hết giờ (hoặc không còn từ nào để nối)
+void end_game_by_timeout(int session_id, int loser_num)
+{
+  GameSession *session = &game_sessions[session_id];
+  if (!session->game_active)
+    return;
+
+  // Xác định người thắng
+  const char *loser_name = player_id_name(loser_num == 1 ? session->player1_id : session->player2_id);
+  const char *winner_name = player_id_name(loser_num == 1 ? session->player2_id : session->player1_id);
+
+  // --- TÍNH ĐIỂM (Càng thắng nhanh càng nhiều điểm) ---
+  // Công thức: 50 điểm gốc + (200 / số lượt).
+  int turns = (session->current_attempts > 0) ? session->current_attempts : 1;
+  int score_change = 50 + (200 / turns);
+
+  // Cập nhật DB
+  User winner_user, loser_user;
+  if (get_user_by_username(db, winner_name, &winner_user) == SQLITE_OK)
+  {
+    update_user_score(db, winner_name, winner_user.score + score_change);
+  }
+  if (get_user_by_username(db, loser_name, &loser_user) == SQLITE_OK)
+  {
+    int new_score = (loser_user.score - score_change < 0) ? 0 : (loser_user.score - score_change);
+    update_user_score(db, loser_name, new_score);
+  }
+
+  // Gửi kết quả
+  Message end_msg;
+  EndNotice notice = {.reason = END_RESULT, .score_change = score_change};
+  strcpy(notice.player, winner_name);
+  end_msg.message_type = GAME_END;
+  end_msg.status = SUCCESS;
+  encode_end_notice(&end_msg, &notice);
+
+  send_to_players(session, &end_msg);
+
+  // Lưu lịch sử và dọn dẹp
+  session->game_active = 0;
+
+  GameHistory game_history;
+  fill_game_history(session, &game_history); // Kèm các nước đi (tối đa 12)
+  strcpy(game_history.winner, winner_name);
+  game_history.player1_score = (loser_num == 2) ? score_change : 0;
+  game_history.player2_score = (loser_num == 1) ? score_change : 0;
+
+  get_time_as_string(game_history.end_time, sizeof(game_history.end_time));
+  snprintf(game_history.word, sizeof(game_history.word), "TIMEUP"); // word chỉ chứa MAX_WORD_LENGTH ký tự
+
+  save_game_history(db, &game_history);
+  clear_game_session(session_id);
+}
+
+// Hết hạn lượt: người đang phải đánh thua, kể cả khi client im lặng hay đã treo
+void turn_timer_expired(Timer *timer)
+{
+  int session_id = (int)(timer - turn_timers);
+  GameSession *session = &game_sessions[session_id];
+  if (!session->game_active)
+    return;
+
+  printf("Turn timed out in session %d\n", session_id);
+  end_game_by_timeout(session_id, session->current_player);
+}
+
+// Chạy trên shard sở hữu session (fd = session_id, payload = tên người thoát)
+void end_game_by_disconnect(int session_id, Message *note)
+{
+  const char *disconnected_player = note->payload;
+  GameSession *session = &game_sessions[session_id];
+  int disconnected_num = session->game_active ? session_player_num(session, disconnected_player) : 0;
+  if (disconnected_num == 0)
+    return;
+  session_forget_client(session, disconnected_num);
+
+  uint32_t opponent_id = disconnected_num == 1 ? session->player2_id : session->player1_id;
+
+  Message message;
+  EndNotice notice = {.reason = END_ABANDONED, .score_change = 0};
+  strcpy(notice.player, disconnected_player); // Thông báo đối thủ out
+  message.message_type = GAME_END;
+  message.status = SUCCESS;
+  encode_end_notice(&message, &notice);
+  send_to_players(session, &message);
+
+  // Lưu lịch sử (đối thủ out thì người còn lại thắng)
+  GameHistory game_history;
+  fill_game_history(session, &game_history);
+  strcpy(game_history.word, session->last_word);
+  game_history.player1_score = session->player1_score;
+  game_history.player2_score = session->player2_score;
+  strcpy(game_history.winner, player_id_name(opponent_id));
+  strcpy(game_history.end_time, session->end_time);
+
+  save_game_history(db, &game_history);
+  clear_game_session(session_id);
+}
+
+// Chạy trên shard sở hữu session (fd = session_id, payload = tên người đăng
+// xuất): kết nối vẫn mở nhưng không còn là của người chơi, ván không gửi tới nữa
+void forget_session_player(int session_id, Message *note)
+{
+  GameSession *session = &game_sessions[session_id];
+  if (session->game_active)
+    session_forget_client(session, session_player_num(session, note->payload));
+}
+
+// Chạy handler(session_id, note) trên shard sở hữu session
+void run_on_session_shard(int session_id, MailHandler handler, Message *note)
+{
+  if (session_shard(session_id) == current_shard())
+    handler(session_id, note);
+  else
+    event_loop_post(&shards[session_shard(session_id)], handler, session_id, note);
+}
+
+void handle_client_disconnect(int client_sock)
+{
+  Message note;
+  int session_id = -1;
+
+  pthread_mutex_lock(&players_lock);
+  PlayerInfo *player = registry_find_sock(client_sock);
+  if (player == NULL)
+  {
+    pthread_mutex_unlock(&players_lock);
+    printf("Disconnected player not found\n");
+    return;
+  }
+  strcpy(note.payload, registry_name(player->player_id));
+  session_id = player->session_id;
+  registry_remove(player);
+  pthread_mutex_unlock(&players_lock);
+  atomic_store(&presence_dirty, 1);
+
+  // Session có thể nằm ở shard khác: chuyển việc kết thúc ván sang đó
+  if (session_id >= 0)
+    run_on_session_shard(session_id, end_game_by_disconnect, &note);
+
+  printf("Player %s disconnected\n", note.payload);
+}
+/***************************************************************************/
+
+/*****************************PRESENCE*************************************/
+
+// Online = đang đăng nhập trên một kết nối còn sống (có trong registry), nên
+// server crash cũng không để lại người "online" giả. Đăng nhập/đăng xuất
+// không ghi database; cột isOnline (cho thống kê) được ghi lại theo lô mỗi
+// presence_flush_ms trong một transaction trên presence_db, chỉ các tên đã đổi.
+int is_player_online(const char *player_name)
+{
+  pthread_mutex_lock(&players_lock);
+  int online = registry_find(player_name) != NULL;
+  pthread_mutex_unlock(&players_lock);
+  return online;
+}
+
+int compare_names(const void *a, const void *b)
+{
+  return strcmp(a, b);
+}
+
+void flush_presence()
+{
+  // Chỉ shard 0 dùng. flushed là tập tên đã ghi online (đã sắp xếp),
+  // flushed_count < 0 khi chưa biết database đang ghi gì
+  static char (*names)[MAX_USERNAME_LEN], (*flushed)[MAX_USERNAME_LEN];
+  static PresenceChange *changes;
+  static int flushed_count = -1;
+  if (presence_flush_ms <= 0 || !atomic_exchange(&presence_dirty, 0))
+    return;
+  int capacity = registry_capacity();
+  if (changes == NULL)
+  {
+    names = malloc(capacity * sizeof(*names));
+    flushed = malloc(capacity * sizeof(*flushed));
+    changes = malloc(2 * capacity * sizeof(*changes));
+    if (names == NULL || flushed == NULL || changes == NULL)
+    {
+      free(names);
+      free(flushed);
+      free(changes);
+      changes = NULL;
+      atomic_store(&presence_dirty, 1);
+      return;
+    }
+  }
+
+  pthread_mutex_lock(&players_lock);
+  int count = registry_count();
+  const PlayerInfo *players = registry_players();
+  for (int i = 0; i < count; i++)
+    strcpy(names[i], registry_name(players[i].player_id));
+  pthread_mutex_unlock(&players_lock);
+  qsort(names, count, sizeof(*names), compare_names);
+
+  // So hai danh sách đã sắp xếp: tên mới online và tên không còn online
+  int change_count = 0, i = 0, j = 0;
+  int old_count = flushed_count < 0 ? 0 : flushed_count;
+  while (i < count || j < old_count)
+  {
+    int order = i == count ? 1 : j == old_count ? -1 : strcmp(names[i], flushed[j]);
+    if (order == 0)
+    {
+      i++;
+      j++;
+      continue;
+    }
+    PresenceChange *change = &changes[change_count++];
+    strcpy(change->username, order < 0 ? names[i++] : flushed[j++]);
+    change->is_online = order < 0;
+  }
+  if (change_count == 0 && flushed_count >= 0)
+    return;
+
+  if (save_users_online(presence_db, changes, change_count, flushed_count < 0) != SQLITE_OK)
+  {
+    atomic_store(&presence_dirty, 1); // Thử lại lần sau
+    return;
+  }
+  char (*swap)[MAX_USERNAME_LEN] = flushed;
+  flushed = names;
+  names = swap;
+  flushed_count = count;
+}
+
+void presence_timer_expired(Timer *timer)
+{
+  flush_presence();
+  event_loop_timer_start(&presence_timer, presence_flush_ms);
+}
+
+// Chạy trên shard 0
+void start_presence_flush(int fd, Message *unused)
+{
+  presence_timer.callback = presence_timer_expired;
+  event_loop_timer_start(&presence_timer, 0);
+}
+
+/***************************************************************************/
+
+/*****************************INIT SERVER*************************************/
+
+// SIGINT/SIGHUP bị chặn và đọc qua signalfd trong vòng lặp sự kiện
+int setup_signal_fd(sigset_t *mask)
+{
+  sigemptyset(mask);
+  sigaddset(mask, SIGINT);
+  sigaddset(mask, SIGHUP);
+  sigaddset(mask, SIGUSR1);
+  sigaddset(mask, SIGUSR2);
+  if (sigprocmask(SIG_BLOCK, mask, NULL) < 0)
+  {
+    perror("sigprocmask");
+    return -1;
+  }
+  signal(SIGPIPE, SIG_IGN); // Client đóng giữa chừng: send() trả lỗi thay vì giết server
+
+  int fd = signalfd(-1, mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (fd < 0)
+    perror("signalfd");
+  return fd;
+}
+
+// Nâng giới hạn fd mềm lên bằng giới hạn cứng để nhận được hàng nghìn kết nối
+void raise_fd_limit()
+{
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+  {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
+// Mỗi shard có socket lắng nghe riêng; SO_REUSEPORT để kernel chia kết nối mới
+int initialize_server(int *server_sock, struct sockaddr_in *server_addr)
+{
+  if ((*server_sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+  {
+    perror("Socket failed");
+    exit(EXIT_FAILURE);
+  }
+
+  int opt = 1;
+  setsockopt(*server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  if (shard_count > 1 && setsockopt(*server_sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+  {
+    perror("SO_REUSEPORT failed");
+    exit(EXIT_FAILURE);
+  }
+
+  server_addr->sin_family = AF_INET;
+  server_addr->sin_addr.s_addr = INADDR_ANY;
+  server_addr->sin_port = htons(PORT);
+
+  if (bind(*server_sock, (struct sockaddr *)server_addr, sizeof(*server_addr)) < 0)
+  {
+    perror("Bind failed");
+    exit(EXIT_FAILURE);
+  }
+
+  if (listen(*server_sock, SOMAXCONN) < 0)
+  {
+    perror("Listen failed");
+    exit(EXIT_FAILURE);
+  }
+
+  return 0;
+}
+
+// Socket AF_UNIX cho bot/công cụ chạy cùng máy: không qua TCP. Mỗi shard
+// nhận trên một bản dup của socket này (xem main)
+int initialize_local_server(const char *path)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    printf("Socket path too long: %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  strcpy(addr.sun_path, path);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+  {
+    perror("Socket failed");
+    exit(EXIT_FAILURE);
+  }
+  unlink(path); // File còn lại từ lần chạy trước
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+  {
+    perror("Bind failed");
+    exit(EXIT_FAILURE);
+  }
+  if (listen(sock, SOMAXCONN) < 0)
+  {
+    perror("Listen failed");
+    exit(EXIT_FAILURE);
+  }
+  return sock;
+}
+
+/***************************************************************************/
+
+void handle_message(int client_sock, Message *message);
+
+// Shard phải xử lý message: session thuộc shard i % shard_count, GAME_START theo
+// cặp người chơi. Các message khác chỉ dùng registry/database nên chạy tại chỗ.
+int message_shard(const Message *message)
+{
+  switch (message->message_type)
+  {
+  case GAME_GET_TARGET:
+  case GAME_HINT:
+  case GAME_GUESS:
+  case GAME_UPDATE:
+  case GAME_END:
+  case GAME_TIMEOUT:
+  {
+    int session_id = message_session_id(message);
+    if (session_id >= 0 && session_id < MAX_SESSIONS)
+      return session_shard(session_id);
+    break;
+  }
+  case GAME_START:
+  {
+    StartRequest request;
+    if (decode_start_request(message, &request) == 0)
+      return pair_shard(request.player1, request.player2);
+    break;
+  }
+  default:
+    break;
+  }
+  return current_shard();
+}
+
+void route_message(int client_sock, Message *message)
+{
+  int shard = message_shard(message);
+  if (shard != current_shard())
+    event_loop_post_client(&shards[shard], handle_message, client_sock, message); // Bỏ nếu client đóng trước khi tới lượt
+  else
+    handle_message(client_sock, message);
+}
+
+/*****************************DRAIN*************************************/
+
+void stop_accepting(int fd, Message *message)
+{
+  event_loop_stop_accepting();
+}
+
+// Trên mỗi shard: báo người chơi các ván còn dang dở; ván vẫn giữ game_active
+// để save_unfinished_games lưu lại sau khi mọi shard dừng
+void notify_unfinished_games(int fd, Message *unused)
+{
+  for (int i = current_shard(); i < MAX_SESSIONS; i += shard_count)
+  {
+    GameSession *session = &game_sessions[i];
+    if (!session->game_active)
+      continue;
+    event_loop_timer_cancel(&turn_timers[i]);
+
+    Message message;
+    EndNotice notice = {.reason = END_SHUTDOWN, .score_change = 0};
+    message.message_type = GAME_END;
+    message.status = SUCCESS;
+    encode_end_notice(&message, &notice);
+    send_to_players(session, &message);
+  }
+}
+
+void stop_server(Timer *timer)
+{
+  event_loop_stop(&shards[0]); // main() dừng các shard còn lại
+}
+
+void finish_drain()
+{
+  if (drain_finishing)
+    return;
+  drain_finishing = 1;
+  event_loop_timer_cancel(&drain_timer);
+
+  Message none = {0};
+  printf("Drain finished, %d games left unfinished\n", admission_in_use(ADMIT_SESSION));
+  for (int i = 0; i < shard_count; i++)
+    event_loop_post(&shards[i], notify_unfinished_games, -1, &none);
+  drain_timer.callback = stop_server;
+  event_loop_timer_start(&drain_timer, DRAIN_FLUSH_MS);
+}
+
+void check_drain(Timer *timer)
+{
+  if (admission_in_use(ADMIT_SESSION) == 0 || drain_checks_left-- <= 0)
+    finish_drain();
+  else
+    event_loop_timer_start(&drain_timer, DRAIN_CHECK_MS);
+}
+
+void start_drain()
+{
+  Message none = {0};
+  atomic_store(&draining, 1);
+  printf("Draining: waiting up to %d ms for %d active games\n", drain_timeout_ms, admission_in_use(ADMIT_SESSION));
+  for (int i = 0; i < shard_count; i++)
+    event_loop_post(&shards[i], stop_accepting, -1, &none);
+
+  drain_checks_left = drain_timeout_ms / DRAIN_CHECK_MS;
+  drain_timer.callback = check_drain;
+  event_loop_timer_start(&drain_timer, 0);
+}
+
+// Sau khi mọi shard đã dừng: ghi các ván dang dở (không cộng/trừ điểm) cùng một transaction
+void save_unfinished_games()
+{
+  static GameHistory histories[MAX_SESSIONS];
+  int count = 0;
+
+  for (int i = 0; i < MAX_SESSIONS; i++)
+  {
+    GameSession *session = &game_sessions[i];
+    if (!session->game_active)
+      continue;
+
+    GameHistory *game_history = &histories[count++];
+    fill_game_history(session, game_history);
+    game_history->player1_score = session->player1_score;
+    game_history->player2_score = session->player2_score;
+    if (session->player1_score != session->player2_score)
+      strcpy(game_history->winner, session->player1_score > session->player2_score ? game_history->player1 : game_history->player2);
+    else
+      strcpy(game_history->winner, "DRAW");
+    snprintf(game_history->word, sizeof(game_history->word), "HALTED"); // Ván dừng do tắt server
+    get_time_as_string(game_history->end_time, sizeof(game_history->end_time));
+  }
+
+  if (count > 0 && save_game_histories(db, histories, count) == SQLITE_OK)
+    printf("Saved %d unfinished games\n", count);
+}
+
+/*****************************UPGRADE*************************************/
+
+// SIGUSR2: chuyển server cho binary mới (argv[0]) mà người chơi không bị ngắt.
+// Các shard dừng nhưng giữ nguyên client; tiến trình mới được exec với
+// --upgrade-fd và nhận qua socketpair (SCM_RIGHTS, xem handoff.h): listen
+// socket của từng shard, từng client kèm byte đọc dở/chưa gửi, danh sách
+// người chơi và các ván đang chơi. Tiến trình mới gửi ACK thì tiến trình cũ
+// thoát; lỗi hoặc quá UPGRADE_ACK_TIMEOUT_S thì tiến trình cũ chạy tiếp.
+enum
+{
+  UPGRADE_HELLO = 1,
+  UPGRADE_LISTENERS, // int32 có socket AF_UNIX không; fd: listen socket của shard 0..n-1, rồi socket AF_UNIX
+  UPGRADE_CLIENT,    // UpgradeClient, byte đọc dở, byte chưa gửi; fd: socket client
+  UPGRADE_PLAYERS,   // int32 số người chơi, UpgradePlayer[]
+  UPGRADE_SESSION,   // UpgradeSession, GameSession, uint32 key các từ đã dùng
+  UPGRADE_END,
+  UPGRADE_ACK,
+};
+
+// Hai binary phải cùng bố cục GameSession/UpgradePlayer vì chúng được gửi nguyên khối
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t session_size;
+  uint32_t player_size;
+} UpgradeHello;
+
+// Id người chơi chỉ có nghĩa trong một tiến trình: gửi kèm tên để tiến trình mới cấp id lại
+typedef struct
+{
+  char name[MAX_USERNAME_LEN];
+  int32_t sock;
+  int32_t session_id;
+} UpgradePlayer;
+
+typedef struct
+{
+  int32_t fd; // Số fd ở tiến trình cũ, để đổi player_sock
+  uint32_t in_len;
+  uint32_t out_len;
+} UpgradeClient;
+
+// Từ đã dùng gửi dạng key vì chỉ số từ điển có thể khác ở binary mới
+typedef struct
+{
+  int32_t session_id;
+  int32_t turn_ms; // -1: lượt không có hạn
+  int32_t used_count;
+  char player1[MAX_USERNAME_LEN];
+  char player2[MAX_USERNAME_LEN];
+} UpgradeSession;
+
+void request_upgrade()
+{
+  if (atomic_load(&draining))
+  {
+    printf("Upgrade ignored: server is draining\n");
+    return;
+  }
+  if (atomic_exchange(&upgrade_requested, 1))
+    return;
+  printf("Upgrade requested, handing over to a new process\n");
+  for (int i = 0; i < shard_count; i++)
+  {
+    shards[i].keep_clients = 1;
+    event_loop_stop(&shards[i]);
+  }
+}
+
+int send_client(const ClientState *client, void *ctx)
+{
+  int sock = *(int *)ctx;
+  UpgradeClient header = {.fd = client->fd, .in_len = (uint32_t)client->in_len, .out_len = (uint32_t)client->out_len};
+  size_t len = sizeof(header) + client->in_len + client->out_len;
+  char *data = malloc(len);
+  if (data == NULL)
+    return -1;
+  memcpy(data, &header, sizeof(header));
+  memcpy(data + sizeof(header), client->in_data, client->in_len);
+  if (client->out_len > 0)
+    memcpy(data + sizeof(header) + client->in_len, client->out_data, client->out_len);
+  int rc = handoff_send(sock, UPGRADE_CLIENT, data, len, &client->fd, 1);
+  free(data);
+  return rc;
+}
+
+int send_players(int sock)
+{
+  char *data = malloc(sizeof(int32_t) + registry_capacity() * sizeof(UpgradePlayer));
+  if (data == NULL)
+    return -1;
+  pthread_mutex_lock(&players_lock);
+  int32_t count = registry_count();
+  const PlayerInfo *players = registry_players();
+  UpgradePlayer *out = (UpgradePlayer *)(data + sizeof(count));
+  memcpy(data, &count, sizeof(count));
+  for (int i = 0; i < count; i++)
+  {
+    memset(&out[i], 0, sizeof(UpgradePlayer));
+    strcpy(out[i].name, registry_name(players[i].player_id));
+    out[i].sock = players[i].player_sock;
+    out[i].session_id = players[i].session_id;
+  }
+  pthread_mutex_unlock(&players_lock);
+  int rc = handoff_send(sock, UPGRADE_PLAYERS, data, sizeof(count) + count * sizeof(UpgradePlayer), NULL, 0);
+  free(data);
+  return rc;
+}
+
+int send_sessions(int sock)
+{
+  static char data[sizeof(UpgradeSession) + sizeof(GameSession) + MAX_WORDS * sizeof(uint32_t)];
+  for (int i = 0; i < MAX_SESSIONS; i++)
+  {
+    GameSession *session = &game_sessions[i];
+    if (!session->game_active)
+      continue;
+
+    const Dictionary *dict = session->dictionary;
+    uint32_t *keys = (uint32_t *)(data + sizeof(UpgradeSession) + sizeof(GameSession));
+    int used = 0;
+    for (int w = 0; w < dict->count && w < MAX_WORDS; w++)
+    {
+      if (word_set_test(session->used_words, w))
+        keys[used++] = dict->keys[w];
+    }
+
+    UpgradeSession header = {.session_id = i, .turn_ms = (int32_t)event_loop_timer_remaining(&turn_timers[i]), .used_count = used};
+    strcpy(header.player1, player_id_name(session->player1_id));
+    strcpy(header.player2, player_id_name(session->player2_id));
+    memcpy(data, &header, sizeof(header));
+    memcpy(data + sizeof(header), session, sizeof(GameSession));
+    size_t len = sizeof(header) + sizeof(GameSession) + used * sizeof(uint32_t);
+    if (handoff_send(sock, UPGRADE_SESSION, data, len, NULL, 0) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+int send_state(int sock)
+{
+  UpgradeHello hello = {HANDOFF_MAGIC, HANDOFF_VERSION, sizeof(GameSession), sizeof(UpgradePlayer)};
+  int listeners[MAX_SHARDS + 1];
+  for (int i = 0; i < shard_count; i++)
+    listeners[i] = shards[i].listen_fd;
+  int32_t has_local = shards[0].local_fd >= 0;
+  if (has_local)
+    listeners[shard_count] = shards[0].local_fd;
+
+  if (handoff_send(sock, UPGRADE_HELLO, &hello, sizeof(hello), NULL, 0) < 0 ||
+      handoff_send(sock, UPGRADE_LISTENERS, &has_local, sizeof(has_local), listeners, shard_count + has_local) < 0 ||
+      event_loop_export_clients(send_client, &sock) != 0 ||
+      send_players(sock) < 0 ||
+      send_sessions(sock) < 0 ||
+      handoff_send(sock, UPGRADE_END, NULL, 0, NULL, 0) < 0)
+  {
+    perror("Upgrade: sending state failed");
+    return -1;
+  }
+
+  struct timeval timeout = {.tv_sec = UPGRADE_ACK_TIMEOUT_S};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  HandoffRecord ack;
+  if (handoff_recv(sock, &ack) < 0)
+  {
+    printf("Upgrade: new process did not take over\n");
+    return -1;
+  }
+  int rc = ack.type == UPGRADE_ACK ? 0 : -1;
+  handoff_record_free(&ack);
+  return rc;
+}
+
+// Gọi sau khi mọi shard đã dừng với keep_clients. Trả 0 khi tiến trình mới đã nhận.
+int hand_off(int argc, char *argv[])
+{
+  int pair[2];
+  if (handoff_socketpair(pair) < 0)
+  {
+    perror("Upgrade: socketpair");
+    return -1;
+  }
+
+  pid_t child = fork();
+  if (child < 0)
+  {
+    perror("Upgrade: fork");
+    close(pair[0]);
+    close(pair[1]);
+    return -1;
+  }
+  if (child == 0)
+  {
+    // Giữ nguyên tham số, bỏ --upgrade-fd của lần nâng cấp trước
+    char fd_arg[16];
+    char *args[argc + 3];
+    int n = 0;
+    snprintf(fd_arg, sizeof(fd_arg), "%d", pair[1]);
+    for (int i = 0; i < argc; i++)
+    {
+      if (strcmp(argv[i], "--upgrade-fd") == 0 && i + 1 < argc)
+        i++;
+      else
+        args[n++] = argv[i];
+    }
+    args[n++] = "--upgrade-fd";
+    args[n++] = fd_arg;
+    args[n] = NULL;
+    execvp(argv[0], args);
+    perror("Upgrade: exec");
+    _exit(127);
+  }
+
+  close(pair[1]);
+  int rc = send_state(pair[0]);
+  close(pair[0]);
+  if (rc < 0)
+  {
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+    return -1;
+  }
+  printf("Handed over to pid %d\n", (int)child);
+  return 0;
+}
+
+// Tiến trình mới, trước khi dựng shard: dùng lại listen socket của tiến trình cũ
+int receive_listeners(int sock)
+{
+  HandoffRecord hello, listeners;
+  UpgradeHello expected = {HANDOFF_MAGIC, HANDOFF_VERSION, sizeof(GameSession), sizeof(UpgradePlayer)};
+  if (handoff_recv(sock, &hello) < 0)
+    return -1;
+  int rc = hello.type == UPGRADE_HELLO && hello.len == sizeof(expected) && memcmp(hello.data, &expected, sizeof(expected)) == 0 ? 0 : -1;
+  handoff_record_free(&hello);
+  if (rc < 0)
+  {
+    printf("Upgrade: previous server is not compatible\n");
+    return -1;
+  }
+
+  if (handoff_recv(sock, &listeners) < 0)
+    return -1;
+  int32_t has_local = 0;
+  if (listeners.type == UPGRADE_LISTENERS && listeners.len == sizeof(has_local))
+    memcpy(&has_local, listeners.data, sizeof(has_local));
+  int count = listeners.fd_count - (has_local != 0);
+  if (listeners.type != UPGRADE_LISTENERS || count < 1 || count > MAX_SHARDS)
+  {
+    handoff_record_free(&listeners);
+    return -1;
+  }
+  shard_count = count; // Cùng số shard để session i vẫn thuộc shard i % shard_count
+  for (int i = 0; i < shard_count; i++)
+    shards[i].listen_fd = listeners.fds[i];
+  if (has_local)
+    local_listener = listeners.fds[shard_count];
+  listeners.fd_count = 0;
+  handoff_record_free(&listeners);
+  return 0;
+}
+
+void restore_client(HandoffRecord *record, int *fd_map, int max_fds)
+{
+  UpgradeClient header;
+  if (record->len < sizeof(header) || record->fd_count != 1)
+    return;
+  memcpy(&header, record->data, sizeof(header));
+  if (record->len != sizeof(header) + header.in_len + header.out_len || header.fd < 0 || header.fd >= max_fds)
+    return;
+
+  int fd = record->fds[0];
+  ClientState client = {
+      .fd = fd,
+      .in_data = record->data + sizeof(header),
+      .in_len = header.in_len,
+      .out_data = record->data + sizeof(header) + header.in_len,
+      .out_len = header.out_len,
+  };
+  if (event_loop_adopt_client(&shards[fd % shard_count], &client) < 0)
+  {
+    printf("Upgrade: cannot take over client %d\n", header.fd);
+    return;
+  }
+  fd_map[header.fd] = fd;
+  record->fd_count = 0; // Đã thuộc event loop
+}
+
+// Người chơi có client không còn thì bỏ, như khi client ngắt kết nối; quá
+// registry_capacity() (--max-connections nhỏ hơn tiến trình cũ) cũng vậy
+void restore_players(HandoffRecord *record, const int *fd_map, int max_fds)
+{
+  int32_t count;
+  if (record->len < sizeof(count))
+    return;
+  memcpy(&count, record->data, sizeof(count));
+  if (count < 0 || count > max_fds || record->len != sizeof(count) + count * sizeof(UpgradePlayer))
+    return;
+
+  const UpgradePlayer *players = (const UpgradePlayer *)(record->data + sizeof(count));
+  for (int i = 0; i < count; i++)
+  {
+    int old_sock = players[i].sock;
+    if (old_sock < 0 || old_sock >= max_fds || fd_map[old_sock] < 0 || memchr(players[i].name, 0, MAX_USERNAME_LEN) == NULL)
+      continue;
+    PlayerInfo *player = registry_add(players[i].name, fd_map[old_sock]);
+    if (player != NULL)
+      player->session_id = players[i].session_id;
+  }
+}
+
+void restore_session(HandoffRecord *record)
+{
+  UpgradeSession header;
+  if (record->len < sizeof(header) + sizeof(GameSession))
+    return;
+  memcpy(&header, record->data, sizeof(header));
+  if (header.session_id < 0 || header.session_id >= MAX_SESSIONS || header.used_count < 0 ||
+      record->len != sizeof(header) + sizeof(GameSession) + header.used_count * sizeof(uint32_t))
+    return;
+
+  int id = header.session_id;
+  GameSession *session = &game_sessions[id];
+  memcpy(session, record->data + sizeof(header), sizeof(GameSession));
+  session->dictionary = NULL; // Con trỏ của tiến trình cũ
+  header.player1[MAX_USERNAME_LEN - 1] = header.player2[MAX_USERNAME_LEN - 1] = '\0';
+  session->player1_id = registry_intern(header.player1); // Id của tiến trình cũ không dùng được
+  session->player2_id = registry_intern(header.player2);
+  session->player1_sock = get_player_client(session->player1_id, &session->player1_generation); // fd và generation cũng vậy
+  session->player2_sock = get_player_client(session->player2_id, &session->player2_generation);
+  Dictionary *dict = NULL;
+  if (session->word_length >= MIN_WORD_LENGTH && session->word_length <= MAX_WORD_LENGTH)
+  {
+    pthread_mutex_lock(&dictionary_lock);
+    dict = current_dictionaries[session->word_length] != NULL ? dict_acquire(current_dictionaries[session->word_length]) : NULL;
+    pthread_mutex_unlock(&dictionary_lock);
+  }
+  if (dict == NULL || session->player1_id == 0 || session->player2_id == 0)
+  {
+    printf("Upgrade: cannot restore game %s (%d-letter words)\n", session->game_id, session->word_length);
+    set_player_session(session->player1_id, id, -1);
+    set_player_session(session->player2_id, id, -1);
+    registry_release(session->player1_id);
+    registry_release(session->player2_id);
+    if (dict != NULL)
+      dict_release(dict);
+    memset(session, 0, sizeof(GameSession));
+    return;
+  }
+
+  // Dựng lại tập từ đã dùng theo chỉ số của từ điển hiện tại
+  session->dictionary = dict;
+  memset(session->used_words, 0, sizeof(session->used_words));
+  for (int l = 0; l < ALPHABET_SIZE; l++)
+    session->remaining_by_letter[l] = dict_count_starting_with(dict, l);
+  const uint32_t *keys = (const uint32_t *)(record->data + sizeof(header) + sizeof(GameSession));
+  for (int k = 0; k < header.used_count; k++)
+  {
+    int index = dict_index_of_key(dict, keys[k]);
+    if (index < 0 || word_set_test(session->used_words, index))
+      continue;
+    word_set_add(session->used_words, index);
+    session->remaining_by_letter[dict_key_first(dict, keys[k])]--;
+  }
+  session->last_key = session->last_word[0] ? dict_pack(dict, session->last_word) : 0;
+
+  restored_turn_ms[id] = header.turn_ms >= 0 ? header.turn_ms : TURN_TIMEOUT_MS;
+  admission_add(ADMIT_SESSION);
+}
+
+// Trên mỗi shard: hạn lượt của các ván nhận từ tiến trình cũ chạy tiếp
+void resume_turn_timers(int fd, Message *unused)
+{
+  for (int i = current_shard(); i < MAX_SESSIONS; i += shard_count)
+  {
+    if (!game_sessions[i].game_active)
+      continue;
+    turn_timers[i].callback = turn_timer_expired;
+    event_loop_timer_start(&turn_timers[i], restored_turn_ms[i]);
+  }
+}
+
+// Tiến trình mới, sau khi dựng shard và trước khi chạy chúng
+int receive_state(int sock, int max_fds)
+{
+  int *fd_map = malloc(max_fds * sizeof(int)); // fd cũ -> fd mới
+  if (fd_map == NULL)
+    return -1;
+  for (int i = 0; i < max_fds; i++)
+    fd_map[i] = -1;
+
+  int clients = 0, rc = 0, done = 0;
+  while (!done && rc == 0)
+  {
+    HandoffRecord record;
+    if (handoff_recv(sock, &record) < 0)
+    {
+      rc = -1;
+      break;
+    }
+    switch (record.type)
+    {
+    case UPGRADE_CLIENT:
+      restore_client(&record, fd_map, max_fds);
+      clients += record.fd_count == 0;
+      break;
+    case UPGRADE_PLAYERS:
+      restore_players(&record, fd_map, max_fds);
+      break;
+    case UPGRADE_SESSION:
+      restore_session(&record);
+      break;
+    case UPGRADE_END:
+      done = 1;
+      break;
+    default:
+      rc = -1;
+      break;
+    }
+    handoff_record_free(&record);
+  }
+  free(fd_map);
+  if (rc < 0)
+  {
+    printf("Upgrade: state from the previous server is incomplete\n");
+    return -1;
+  }
+
+  Message none = {0};
+  for (int i = 0; i < shard_count; i++)
+    event_loop_post(&shards[i], resume_turn_timers, -1, &none);
+  int previous = (int)getppid(); // Tiến trình cũ thoát ngay sau ACK
+  if (handoff_send(sock, UPGRADE_ACK, NULL, 0, NULL, 0) < 0)
+    return -1;
+  close(sock);
+  printf("Took over from pid %d: %d clients, %d players, %d games\n", previous, clients, registry_count(),
+         admission_in_use(ADMIT_SESSION));
+  return 0;
+}
+
+/*****************************BENCH*************************************/
+
+// ./server --bench N: BENCH_PAIRS cặp bot trong tiến trình chơi với nhau qua
+// client loopback (event_loop_loopback_open) tới khi đủ N nước rồi in thông
+// lượng và dừng server. Request của bot vẫn qua route_message/handle_message
+// như client thật, chỉ không có socket và không đăng nhập qua database, nên
+// đo được riêng phần xử lý game. Bot và trạng thái của chúng nằm ở shard 0.
+typedef struct BenchPair BenchPair;
+
+typedef struct
+{
+  BenchPair *pair;
+  int fd;
+  int player_num;
+  char name[WIRE_NAME_SIZE];
+} BenchBot;
+
+struct BenchPair
+{
+  BenchBot bots[2];
+  int session_id;
+  int moves;                         // Số nước của ván hiện tại
+  uint64_t used[USED_WORDS_SIZE];    // Bản sao phía bot của session->used_words
+  uint16_t remaining[ALPHABET_SIZE]; // và của session->remaining_by_letter
+};
+
+BenchPair bench_pairs[BENCH_PAIRS];
+Dictionary *bench_dict;
+long bench_done, bench_games;
+struct timespec bench_started;
+int bench_finished;
+
+void bench_reply(int fd, const Message *message, void *ctx);
+
+void bench_send(BenchBot *bot, Message *message)
+{
+  if (event_loop_loopback_request(bot->fd, message) < 0)
+    printf("Bench: cannot send for %s\n", bot->name);
+}
+
+void bench_new_game(BenchPair *pair)
+{
+  pair->session_id = -1;
+  pair->moves = 0;
+  memset(pair->used, 0, sizeof(pair->used));
+  for (int l = 0; l < ALPHABET_SIZE; l++)
+    pair->remaining[l] = dict_count_starting_with(bench_dict, l);
+  bench_games++;
+
+  Message message;
+  StartRequest request = {.word_length = WORD_LENGTH};
+  strcpy(request.player1, pair->bots[0].name);
+  strcpy(request.player2, pair->bots[1].name);
+  message.message_type = GAME_START;
+  message.status = SUCCESS;
+  encode_start_request(&message, &request);
+  bench_send(&pair->bots[0], &message);
+}
+
+// Chạy trên shard của session: bỏ ván mà không lưu lịch sử
+void bench_clear_session(int session_id, Message *unused)
+{
+  if (game_sessions[session_id].game_active)
+    clear_game_session(session_id);
+}
+
+void bench_drop_game(BenchPair *pair)
+{
+  Message none = {0};
+  if (pair->session_id >= 0 && session_shard(pair->session_id) == current_shard())
+    bench_clear_session(pair->session_id, &none);
+  else if (pair->session_id >= 0)
+    event_loop_post(&shards[session_shard(pair->session_id)], bench_clear_session, pair->session_id, &none);
+  pair->session_id = -1;
+}
+
+void bench_finish()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double elapsed = (now.tv_sec - bench_started.tv_sec) + (now.tv_nsec - bench_started.tv_nsec) / 1e9;
+  bench_finished = 1;
+  printf("Bench: %ld moves in %ld games, %.3f s, %.0f moves/s (%d bot pairs, %d shards)\n", bench_done, bench_games,
+         elapsed, elapsed > 0 ? bench_done / elapsed : 0, BENCH_PAIRS, shard_count);
+  for (int p = 0; p < BENCH_PAIRS; p++)
+  {
+    bench_drop_game(&bench_pairs[p]);
+    for (int b = 0; b < 2; b++)
+      if (bench_pairs[p].bots[b].fd >= 0)
+        event_loop_loopback_close(bench_pairs[p].bots[b].fd);
+  }
+  dict_release(bench_dict);
+  event_loop_stop(&shards[0]); // main() dừng các shard còn lại, không lưu ván của bot
+}
+
+// Từ chưa dùng bắt đầu bằng first (-1: chữ nào cũng được) mà đối thủ còn từ để
+// nối tiếp, để ván không kết thúc (và ghi DB) giữa chừng. 0 nếu không có.
+uint32_t bench_pick(BenchPair *pair, int first)
+{
+  int from = first >= 0 ? first : (int)(pair - bench_pairs) % ALPHABET_SIZE;
+  int to = first >= 0 ? first + 1 : ALPHABET_SIZE;
+  for (int letter = from; letter < to; letter++)
+  {
+    int begin, end;
+    dict_letter_bucket(bench_dict, letter, &begin, &end);
+    for (int i = begin; i < end; i++)
+    {
+      uint32_t key = bench_dict->keys[i];
+      int last = word_key_last(key);
+      if (!word_set_test(pair->used, i) && pair->remaining[last] > (last == letter))
+        return key;
+    }
+  }
+  return 0;
+}
+
+// Lượt của bot: đi một nước, hoặc bỏ ván và mở ván mới
+void bench_move(BenchBot *bot, int first)
+{
+  BenchPair *pair = bot->pair;
+  uint32_t key = pair->moves < BENCH_GAME_MOVES ? bench_pick(pair, first) : 0;
+  if (key == 0)
+  {
+    bench_drop_game(pair);
+    bench_new_game(pair);
+    return;
+  }
+
+  Message message;
+  GuessRequest request = {.session_id = pair->session_id};
+  strcpy(request.player, bot->name);
+  dict_unpack(bench_dict, key, request.word);
+  message.message_type = GAME_GUESS;
   message.status = SUCCESS;
-  printf("Sending score update to %s and %s\n", session->player1_name, session->player2_name);
-  send(get_player_sock(session->player1_name), &message, sizeof(Message), 0);
-  send(get_player_sock(session->player2_name), &message, sizeof(Message), 0);
+  encode_guess_request(&message, &request);
+  bench_send(bot, &message);
 }
 
-void handle_client_disconnect(int client_sock)
+void bench_reply(int fd, const Message *message, void *ctx)
 {
-  char disconnected_player[50];
-  int player_index = -1;
+  BenchBot *bot = ctx;
+  BenchPair *pair = bot->pair;
+  if (bench_finished)
+    return;
+  if (message->status != SUCCESS &&
+      (message->message_type == GAME_START || message->message_type == GAME_GUESS))
+  {
+    printf("Bench: %s refused: %.*s\n", bot->name, (int)message->length, message->payload);
+    bench_finish();
+    return;
+  }
 
-  for (int i = 0; i < player_count; i++)
+  if (message->message_type == GAME_START)
   {
-    if (player_list[i].player_sock == client_sock)
+    StartReply reply;
+    if (decode_start_reply(message, &reply) < 0)
+      return;
+    bot->player_num = reply.player_num;
+    pair->session_id = reply.session_id;
+    if (bot == &pair->bots[0])
     {
-      strcpy(disconnected_player, player_list[i].player_name);
-      player_index = i;
-      break;
+      Message join = *message; // Người thứ hai vào ván với cùng request
+      StartRequest request = {.word_length = WORD_LENGTH};
+      strcpy(request.player1, pair->bots[0].name);
+      strcpy(request.player2, pair->bots[1].name);
+      encode_start_request(&join, &request);
+      bench_send(&pair->bots[1], &join);
+    }
+    else
+    {
+      bench_move(&pair->bots[reply.player_num == 1 ? 1 : 0], -1);
     }
   }
-
-  if (player_index == -1)
+  else if (message->message_type == GAME_GUESS)
   {
-    printf("Disconnected player not found\n");
-    return;
+    // Cả hai bot nhận kết quả; chỉ bot đi tiếp xử lý
+    GuessReply reply;
+    if (decode_guess_reply(message, &reply) < 0 || reply.outcome != GUESS_CONTINUE || reply.next_player != bot->player_num)
+      return;
+    uint32_t key = dict_pack(bench_dict, reply.word);
+    int index = dict_index_of_key(bench_dict, key);
+    if (index >= 0)
+    {
+      word_set_add(pair->used, index);
+      pair->remaining[dict_key_first(bench_dict, key)]--;
+    }
+    pair->moves++;
+    if (++bench_done >= bench_moves)
+      bench_finish();
+    else
+      bench_move(bot, word_key_last(key));
   }
+}
 
-  for (int i = player_index; i < player_count - 1; i++)
+// Chạy trên shard 0 trước mọi message khác
+void start_bench(int fd, Message *unused)
+{
+  pthread_mutex_lock(&dictionary_lock);
+  bench_dict = dict_acquire(current_dictionaries[WORD_LENGTH]);
+  pthread_mutex_unlock(&dictionary_lock);
+  printf("Bench: %d bot pairs playing %d moves over loopback\n", BENCH_PAIRS, bench_moves);
+  clock_gettime(CLOCK_MONOTONIC, &bench_started);
+
+  for (int p = 0; p < BENCH_PAIRS; p++)
   {
-    player_list[i] = player_list[i + 1];
+    bench_pairs[p].session_id = -1;
+    bench_pairs[p].bots[0].fd = bench_pairs[p].bots[1].fd = -1;
   }
-  player_count--;
-
-  for (int i = 0; i < MAX_SESSIONS; i++)
+  for (int p = 0; p < BENCH_PAIRS; p++)
   {
-    GameSession *session = &game_sessions[i];
-    if (session->game_active &&
-        (strcmp(session->player1_name, disconnected_player) == 0 ||
-         strcmp(session->player2_name, disconnected_player) == 0))
+    BenchPair *pair = &bench_pairs[p];
+    for (int b = 0; b < 2; b++)
     {
-      const char *opponent = strcmp(session->player1_name, disconnected_player) == 0 ? session->player2_name : session->player1_name;
-      int opponent_sock = get_player_sock(opponent);
-
-      Message message;
-      message.message_type = GAME_END;
-      message.status = SUCCESS;
-      sprintf(message.payload, "%s", disconnected_player); // Thông báo đối thủ out
-      send(opponent_sock, &message, sizeof(Message), 0);
-
-      // Lưu lịch sử (đối thủ out thì người còn lại thắng)
-      GameHistory game_history;
-      strcpy(game_history.game_id, session->game_id);
-      strcpy(game_history.player1, session->player1_name);
-      strcpy(game_history.player2, session->player2_name);
-      strcpy(game_history.word, session->last_word);
-      game_history.player1_score = session->player1_score;
-      game_history.player2_score = session->player2_score;
-
-      if (strcmp(disconnected_player, session->player1_name) == 0)
-        strcpy(game_history.winner, session->player2_name);
-      else
-        strcpy(game_history.winner, session->player1_name);
-
-      strcpy(game_history.start_time, session->start_time);
-      strcpy(game_history.end_time, session->end_time);
-
-      for (int j = 0; j < MAX_ATTEMPTS; j++)
+      BenchBot *bot = &pair->bots[b];
+      bot->pair = pair;
+      snprintf(bot->name, sizeof(bot->name), "bench-%d%c", p, 'a' + b);
+      bot->fd = event_loop_loopback_open(bench_reply, bot);
+      if (bot->fd < 0 || add_player(bot->name, bot->fd) < 0)
       {
-        if (strlen(session->turns[j].guess) == 0)
-          break;
-        strcpy(game_history.moves[j].player_name, session->turns[j].player_name);
-        strcpy(game_history.moves[j].guess, session->turns[j].guess);
-        strcpy(game_history.moves[j].result, session->turns[j].result);
+        printf("Bench: cannot add bot %s\n", bot->name);
+        bench_finish();
+        return;
       }
-
-      save_game_history(db, &game_history);
-      clear_game_session(i);
-      break;
     }
   }
-
-  printf("Player %s disconnected\n", disconnected_player);
-  close(client_sock);
-}
-/***************************************************************************/
-
-/*****************************INIT SERVER*************************************/
-
-void signal_handler(int sig)
-{
-  got_signal = 1;
-  printf("Caught signal %d\n", sig);
+  for (int p = 0; p < BENCH_PAIRS; p++)
+    bench_new_game(&bench_pairs[p]);
 }
 
-void setup_signal_handler()
-{
-  struct sigaction sa;
-  sa.sa_handler = signal_handler;
-  sa.sa_flags = 0;
-  sigemptyset(&sa.sa_mask);
-  sigaction(SIGINT, &sa, NULL);
-}
+/***************************************************************************/
 
-int initialize_server(int *server_sock, struct sockaddr_in *server_addr)
+// SIGHUP: nạp lại từ điển, SIGUSR1: in số liệu admission, SIGUSR2: nâng cấp binary,
+// SIGINT: dừng êm (lần hai: dừng ngay, vẫn lưu các ván dang dở)
+int handle_signal(int signo)
 {
-  if ((*server_sock = socket(AF_INET, SOCK_STREAM, 0)) == 0)
+  if (signo == SIGHUP)
   {
-    perror("Socket failed");
-    exit(EXIT_FAILURE);
+    start_dictionary_reload();
+    return 0;
   }
-
-  server_addr->sin_family = AF_INET;
-  server_addr->sin_addr.s_addr = INADDR_ANY;
-  server_addr->sin_port = htons(PORT);
-
-  if (bind(*server_sock, (struct sockaddr *)server_addr, sizeof(*server_addr)) < 0)
+  if (signo == SIGUSR1)
   {
-    perror("Bind failed");
-    exit(EXIT_FAILURE);
+    admission_report(stdout);
+    return 0;
   }
-
-  if (listen(*server_sock, 30) < 0)
+  if (signo == SIGUSR2)
   {
-    perror("Listen failed");
-    exit(EXIT_FAILURE);
+    request_upgrade();
+    return 0;
   }
-
-  printf("Server listening on port %d\n", PORT);
+  printf("Caught signal %d\n", signo);
+  if (!atomic_load(&draining))
+    start_drain();
+  else
+    finish_drain();
   return 0;
 }
 
-/***************************************************************************/
+EventBackend backend = EVENT_BACKEND_EPOLL;
 
-void handle_message(int client_sock, Message *message);
+void *run_shard(void *arg)
+{
+  EventLoop *loop = arg;
+  if (event_loop_run(loop, backend) < 0 && backend != EVENT_BACKEND_EPOLL)
+  {
+    printf("Shard %d: %s unavailable, falling back to epoll\n", loop->index, event_backend_name(backend));
+    event_loop_run(loop, EVENT_BACKEND_EPOLL);
+  }
+  return NULL;
+}
 
-int main()
+// ./server [--io-uring] [--threads N] [--max-connections N] [--max-sessions N]
+//          [--max-db-pending N] [--retry-after MS] [--drain-timeout MS]
+//          [--unix PATH] [--bench MOVES] [--presence-flush MS]
+// Mặc định epoll, một shard mỗi CPU; giới hạn = 0 là không giới hạn.
+// --max-db-pending giới hạn số yêu cầu database chạy cùng lúc, không phải độ
+// dài hàng đợi: mỗi shard gọi database đồng bộ, tối đa một yêu cầu một lúc,
+// nên chỉ có tác dụng khi nhỏ hơn số shard.
+// --upgrade-fd chỉ dùng nội bộ khi nâng cấp (xem hand_off).
+int main(int argc, char *argv[])
 {
-  int server_sock, new_sock, client_socks[MAX_CLIENTS] = {0};
-  struct sockaddr_in server_addr, client_addr;
-  fd_set readfds;
-  socklen_t addr_len = sizeof(client_addr);
-  sigset_t block_mask, orig_mask;
+  struct sockaddr_in server_addr;
+  sigset_t signal_mask;
+  pthread_t threads[MAX_SHARDS];
+  AdmissionLimits limits = {.limit = {-1, MAX_SESSIONS, 0}, .retry_after_ms = DEFAULT_RETRY_AFTER_MS};
+
+  shard_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--io-uring") == 0)
+      backend = EVENT_BACKEND_IO_URING;
+    else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+      shard_count = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--max-connections") == 0 && i + 1 < argc)
+      limits.limit[ADMIT_CONNECTION] = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--max-sessions") == 0 && i + 1 < argc)
+      limits.limit[ADMIT_SESSION] = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--max-db-pending") == 0 && i + 1 < argc)
+      limits.limit[ADMIT_DATABASE] = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--retry-after") == 0 && i + 1 < argc)
+      limits.retry_after_ms = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--drain-timeout") == 0 && i + 1 < argc)
+      drain_timeout_ms = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--upgrade-fd") == 0 && i + 1 < argc)
+      upgrade_fd = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--unix") == 0 && i + 1 < argc)
+      local_path = argv[++i];
+    else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc)
+      bench_moves = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--presence-flush") == 0 && i + 1 < argc)
+      presence_flush_ms = atoi(argv[++i]);
+  }
+  if (shard_count < 1)
+    shard_count = 1;
+  if (shard_count > MAX_SHARDS)
+    shard_count = MAX_SHARDS;
+  if (upgrade_fd >= 0)
+    fcntl(upgrade_fd, F_SETFD, FD_CLOEXEC);
 
   int rc = open_database();
   if (rc)
     return 1;
 
   init_wordle();
-  setup_signal_handler();
+  raise_fd_limit();
 
-  sigemptyset(&block_mask);
-  sigaddset(&block_mask, SIGINT);
-  sigprocmask(SIG_BLOCK, &block_mask, &orig_mask);
-
-  initialize_server(&server_sock, &server_addr);
+  // Chặn tín hiệu trước khi tạo luồng để chỉ signalfd của shard 0 nhận
+  int signal_fd = setup_signal_fd(&signal_mask);
+  if (signal_fd < 0)
+    exit(EXIT_FAILURE);
 
-  while (1)
+  struct rlimit limit;
+  int max_fds = MAX_CONNECTIONS;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < (rlim_t)max_fds)
+    max_fds = (int)limit.rlim_cur;
+
+  // Mặc định nhận tới khi gần hết fd; quá giới hạn client nhận 503 thay vì bị bỏ lơ
+  if (limits.limit[ADMIT_CONNECTION] < 0 || limits.limit[ADMIT_CONNECTION] > max_fds - CONNECTION_FD_RESERVE)
+    limits.limit[ADMIT_CONNECTION] = max_fds > 2 * CONNECTION_FD_RESERVE ? max_fds - CONNECTION_FD_RESERVE : max_fds / 2;
+  // Mỗi kết nối đăng nhập tối đa một người chơi; mỗi session giữ thêm tên hai người
+  int max_players = limits.limit[ADMIT_CONNECTION] > 0 ? limits.limit[ADMIT_CONNECTION] : max_fds;
+  if (event_loop_init(max_fds) < 0 || registry_init(max_fds, max_players, max_players + 2 * MAX_SESSIONS) < 0)
   {
-    FD_ZERO(&readfds);
-    FD_SET(server_sock, &readfds);
-    int max_sd = server_sock;
+    printf("Cannot allocate connection table\n");
+    exit(EXIT_FAILURE);
+  }
+  if (limits.limit[ADMIT_SESSION] <= 0 || limits.limit[ADMIT_SESSION] > MAX_SESSIONS)
+    limits.limit[ADMIT_SESSION] = MAX_SESSIONS;
+  admission_configure(&limits);
+  admission_report(stdout);
 
-    for (int i = 0; i < MAX_CLIENTS; i++)
-    {
-      int sock = client_socks[i];
-      if (sock > 0)
-        FD_SET(sock, &readfds);
-      if (sock > max_sd)
-        max_sd = sock;
-    }
+  if (upgrade_fd >= 0 && receive_listeners(upgrade_fd) < 0)
+  {
+    printf("Upgrade: cannot take over the listening sockets\n");
+    exit(EXIT_FAILURE);
+  }
+  if (upgrade_fd < 0 && local_path != NULL)
+    local_listener = initialize_local_server(local_path);
+  for (int i = 0; i < shard_count; i++)
+  {
+    EventLoop *loop = &shards[i];
+    if (upgrade_fd < 0)
+      initialize_server(&loop->listen_fd, &server_addr);
+    if (event_loop_open(loop) < 0)
+      exit(EXIT_FAILURE);
+    loop->local_fd = local_listener < 0 ? -1 : i == 0 ? local_listener : fcntl(local_listener, F_DUPFD_CLOEXEC, 0);
+    loop->index = i;
+    loop->signal_fd = i == 0 ? signal_fd : -1;
+    loop->wakeup_fd = i == 0 ? reload_pipe[0] : -1;
+    loop->on_message = route_message;
+    loop->on_disconnect = handle_client_disconnect;
+    loop->on_wakeup = publish_pending_dictionary;
+    loop->on_signal = handle_signal;
+  }
+  if (upgrade_fd >= 0 && receive_state(upgrade_fd, max_fds) < 0)
+    exit(EXIT_FAILURE); // Tiến trình cũ không nhận được ACK nên chạy tiếp
+  printf("Server listening on port %d (%d shards, %s event loop)\n", PORT, shard_count, event_backend_name(backend));
+  if (local_listener >= 0)
+    printf("Also listening on %s\n", local_path != NULL ? local_path : "the inherited local socket");
+  if (bench_moves > 0)
+  {
+    Message none = {0};
+    event_loop_post(&shards[0], start_bench, -1, &none);
+  }
+  if (presence_flush_ms > 0)
+  {
+    Message none = {0};
+    if (upgrade_fd < 0)
+      atomic_store(&presence_dirty, 1); // isOnline có thể còn sót từ lần chạy trước
+    event_loop_post(&shards[0], start_presence_flush, -1, &none);
+  }
 
-    int ready = pselect(max_sd + 1, &readfds, NULL, NULL, NULL, &orig_mask);
-    if (ready == -1)
+  int handed_off = 0;
+  while (1)
+  {
+    for (int i = 1; i < shard_count; i++)
     {
-      if (errno == EINTR)
-      {
-        if (got_signal)
-          break;
-        continue;
-      }
-      else
+      if (pthread_create(&threads[i], NULL, run_shard, &shards[i]) != 0)
       {
-        perror("pselect");
+        perror("pthread_create");
         exit(EXIT_FAILURE);
       }
     }
+    run_shard(&shards[0]);
+
+    // Shard 0 nhận SIGINT; dừng các shard còn lại rồi chờ chúng đóng client
+    for (int i = 1; i < shard_count; i++)
+      event_loop_stop(&shards[i]);
+    for (int i = 1; i < shard_count; i++)
+      pthread_join(threads[i], NULL);
+    if (!atomic_load(&upgrade_requested))
+      break;
 
-    if (FD_ISSET(server_sock, &readfds))
-    {
-      if ((new_sock = accept(server_sock, (struct sockaddr *)&client_addr, &addr_len)) < 0)
-      {
-        perror("Accept failed");
-        continue;
-      }
-      for (int i = 0; i < MAX_CLIENTS; i++)
-      {
-        if (client_socks[i] == 0)
-        {
-          client_socks[i] = new_sock;
-          break;
-        }
-      }
-    }
-
-    for (int i = 0; i < MAX_CLIENTS; i++)
+    // Nâng cấp: xử lý nốt mailbox rồi chuyển giao; lỗi thì chạy tiếp với client cũ
+    event_loop_settle(shards, shard_count);
+    if (hand_off(argc, argv) == 0)
     {
-      int sock = client_socks[i];
-      if (FD_ISSET(sock, &readfds))
-      {
-        Message message;
-        int read_size = recv(sock, &message, sizeof(Message), 0);
-        if (read_size == 0)
-        {
-          handle_client_disconnect(sock);
-          close(sock);
-          client_socks[i] = 0;
-        }
-        else
-        {
-          handle_message(sock, &message);
-        }
-      }
-    }
-
-    if (got_signal)
+      handed_off = 1;
       break;
+    }
+    printf("Upgrade failed, still serving\n");
+    event_loop_cancel_handoff(shards, shard_count);
+    atomic_store(&upgrade_requested, 0);
   }
-
+  close(signal_fd);
+
+  // Sau khi chuyển giao, client và listen socket thuộc tiến trình mới: chỉ thoát.
+  // Ván của bot benchmark không được lưu.
+  if (!handed_off && bench_moves == 0)
+    save_unfinished_games();
+  if (!handed_off && presence_flush_ms > 0)
+    save_users_online(presence_db, NULL, 0, 1); // Kết nối đã đóng hết: không còn ai online
   close_database();
-  close(server_sock);
+  if (handed_off)
+    return 0;
+  if (local_path != NULL)
+    unlink(local_path);
+  for (int i = 0; i < shard_count; i++)
+    if (shards[i].listen_fd >= 0)
+      close(shards[i].listen_fd);
   printf("Server stopped.\n");
   return 0;
 }
 
+// Yêu cầu chỉ đọc/ghi database; bị từ chối (503) khi đã có --max-db-pending
+// yêu cầu đang chạy trên các shard khác. LOGOUT và lưu kết quả ván không bao giờ bị bỏ.
+int is_database_request(enum MessageType type)
+{
+  switch (type)
+  {
+  case SIGNUP_REQUEST:
+  case LOGIN_REQUEST:
+  case GET_SCORE_BY_USER_REQUEST:
+  case LIST_USER:
+  case LIST_GAME_HISTORY:
+  case GAME_DETAIL_REQUEST:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+void process_message(int client_sock, Message *message);
+
 void handle_message(int client_sock, Message *message)
+{
+  int uses_database = is_database_request(message->message_type);
+  if (uses_database && !admission_acquire(ADMIT_DATABASE))
+  {
+    admission_refuse(message, ADMIT_DATABASE);
+    send_message(client_sock, message);
+    return;
+  }
+  process_message(client_sock, message);
+  if (uses_database)
+    admission_release(ADMIT_DATABASE);
+}
+
+void process_message(int client_sock, Message *message)
 {
   switch (message->message_type)
   {
@@ -531,7 +2104,7 @@ void handle_message(int client_sock, Message *message)
         strcpy(message->payload, "Error occurred while registering user.");
       }
     }
-    send(client_sock, message, sizeof(Message), 0);
+    send_message(client_sock, message);
     break;
   }
 
@@ -544,25 +2117,17 @@ void handle_message(int client_sock, Message *message)
 
     if (login_status == 1)
     {
-      int update_status = update_user_online(db, username);
-      if (update_status != SQLITE_DONE)
+      // Online chỉ ghi vào registry, database được cập nhật sau (PRESENCE)
+      message->status = SUCCESS;
+      strcpy(message->payload, "Login successful");
+      if (add_player(username, client_sock) == 0)
       {
-        message->status = INTERNAL_SERVER_ERROR;
-        strcpy(message->payload, "Failed to update user status");
+        printf("Player %s connected with socket %d\n", username, client_sock);
       }
       else
       {
-        message->status = SUCCESS;
-        strcpy(message->payload, "Login successful");
-        if (add_player(username, client_sock) == 0)
-        {
-          printf("Player %s connected with socket %d\n", username, client_sock);
-        }
-        else
-        {
-          printf("Failed to add player %s\n", username);
-          close(client_sock);
-        }
+        printf("Failed to add player %s\n", username);
+        shutdown(client_sock, SHUT_RDWR); // Vòng lặp sự kiện sẽ thấy hangup và đóng fd
       }
     }
     else if (login_status == 0)
@@ -575,7 +2140,7 @@ void handle_message(int client_sock, Message *message)
       message->status = INTERNAL_SERVER_ERROR;
       strcpy(message->payload, "Login failed");
     }
-    send(client_sock, message, sizeof(Message), 0);
+    send_message(client_sock, message);
     break;
   }
   case LOGOUT_REQUEST:
@@ -586,26 +2151,24 @@ void handle_message(int client_sock, Message *message)
     int auth_status = authenticate_user(db, username, password);
     if (auth_status == 1)
     {
-      int update_status = update_user_offline(db, username);
-      if (update_status == SQLITE_DONE || update_status == SQLITE_OK)
+      message->status = SUCCESS;
+      strcpy(message->payload, "Logout successful");
+      // Bỏ khỏi registry: socket đó đăng nhập lại được, ngắt kết nối sau đó không còn là của người chơi này
+      int session_id = -1;
+      pthread_mutex_lock(&players_lock);
+      PlayerInfo *player = registry_find(username);
+      if (player != NULL)
       {
-        message->status = SUCCESS;
-        strcpy(message->payload, "Logout successful");
-        // Clear PlayerInfo
-        for (int i = 0; i < MAX_PLAYERS; i++)
-        {
-          if (strcmp(player_list[i].player_name, username) == 0)
-          {
-            player_list[i].player_sock = -1;                                           // Clear the player's socket
-            memset(player_list[i].player_name, 0, sizeof(player_list[i].player_name)); // Clear the player's name
-            break;
-          }
-        }
+        session_id = player->session_id;
+        registry_remove(player);
       }
-      else
+      pthread_mutex_unlock(&players_lock);
+      atomic_store(&presence_dirty, 1);
+      if (session_id >= 0)
       {
-        message->status = INTERNAL_SERVER_ERROR;
-        strcpy(message->payload, "Failed to update user status");
+        Message note;
+        strcpy(note.payload, username);
+        run_on_session_shard(session_id, forget_session_player, &note);
       }
     }
     else if (auth_status == 0)
@@ -618,7 +2181,7 @@ void handle_message(int client_sock, Message *message)
       message->status = INTERNAL_SERVER_ERROR;
       strcpy(message->payload, "Logout failed");
     }
-    send(client_sock, message, sizeof(Message), 0);
+    send_message(client_sock, message);
     break;
   }
   case GET_SCORE_BY_USER_REQUEST:
@@ -645,7 +2208,7 @@ void handle_message(int client_sock, Message *message)
       strcpy(message->payload, "Error retrieving score");
     }
 
-    send(client_sock, message, sizeof(Message), 0);
+    send_message(client_sock, message);
     break;
   }
   case LIST_USER:
@@ -659,14 +2222,17 @@ void handle_message(int client_sock, Message *message)
     int rc = list_users_closest_score(db, username, users, &user_count);
     if (rc == SQLITE_OK)
     {
-      char response[2048] = {0};
+      char response[sizeof(message->payload)] = {0};
       char buffer[128];
 
       for (int i = 0; i < user_count; i++)
       {
+        users[i].is_online = is_player_online(users[i].username); // Không tin cột isOnline
         snprintf(buffer, sizeof(buffer), "ID: %d, Username: %s, Score: %d, Online: %d\n",
                  users[i].id, users[i].username, users[i].score, users[i].is_online);
-        strncat(response, buffer, 2048 - strlen(response) - 1);
+        if (strlen(response) + strlen(buffer) >= sizeof(response))
+          break; // Chỉ gửi các dòng vừa payload
+        strcat(response, buffer);
       }
 
       if (strlen(response) > 1)
@@ -687,7 +2253,7 @@ void handle_message(int client_sock, Message *message)
       strcpy(message->payload, "Internal server error occurred.");
     }
 
-    send(client_sock, message, sizeof(Message), 0);
+    send_message(client_sock, message);
     break;
   }
   case CHALLANGE_REQUEST:
@@ -701,26 +2267,20 @@ void handle_message(int client_sock, Message *message)
     {
       message->status = BAD_REQUEST;
       strcpy(message->payload, "Player not found");
-      send(client_sock, message, sizeof(Message), 0);
+      send_message(client_sock, message);
       return;
     }
-    // Check if players are already in a game
-    for (int i = 0; i < MAX_SESSIONS; i++)
+    // Check if players are already in a game (registry knows sessions on every shard)
+    if (get_player_session(player1) >= 0 || get_player_session(player2) >= 0)
     {
-      GameSession *session = &game_sessions[i];
-      if (session->game_active &&
-          (strcmp(session->player1_name, player1) == 0 || strcmp(session->player2_name, player1) == 0 ||
-           strcmp(session->player1_name, player2) == 0 || strcmp(session->player2_name, player2) == 0))
-      {
-        message->status = BAD_REQUEST;
-        strcpy(message->payload, "One or both players are already in a game");
-        send(client_sock, message, sizeof(Message), 0);
-        return;
-      }
+      message->status = BAD_REQUEST;
+      strcpy(message->payload, "One or both players are already in a game");
+      send_message(client_sock, message);
+      return;
     }
     message->status = SUCCESS;
-    send(player1_sock, message, sizeof(Message), 0);
-    send(player2_sock, message, sizeof(Message), 0);
+    int socks[2] = {player1_sock, player2_sock};
+    broadcast_message(socks, NULL, 2, message);
     break;
   }
   case CHALLANGE_RESPONSE:
@@ -733,21 +2293,20 @@ void handle_message(int client_sock, Message *message)
     {
       message->status = BAD_REQUEST;
       strcpy(message->payload, "Player not found");
-      send(client_sock, message, sizeof(Message), 0);
+      send_message(client_sock, message);
       return;
     }
     if (strcmp(response, "ACCEPT") == 0)
     {
       message->status = SUCCESS;
-      send(player1_sock, message, sizeof(Message), 0);
-
-      send(player2_sock, message, sizeof(Message), 0);
+      int socks[2] = {player1_sock, player2_sock};
+      broadcast_message(socks, NULL, 2, message);
     }
     else
     {
       message->status = BAD_REQUEST;
       strcpy(message->payload, "Challange rejected");
-      send(player1_sock, message, sizeof(Message), 0);
+      send_message(player1_sock, message);
     }
     break;
   }
@@ -755,8 +2314,17 @@ void handle_message(int client_sock, Message *message)
   {
     printf("Received game request\n");
 
-    char player1_name[50], player2_name[50];
-    sscanf(message->payload, "%49[^|]|%49s", player1_name, player2_name); // Lấy tên của cả 2 người chơi
+    // Tên của cả 2 người chơi; word_length = 0 thì dùng mặc định WORD_LENGTH chữ
+    StartRequest request;
+    if (decode_start_request(message, &request) < 0)
+    {
+      message_set_text(message, BAD_REQUEST, "Malformed request");
+      send_message(client_sock, message);
+      break;
+    }
+    const char *player1_name = request.player1, *player2_name = request.player2;
+    int word_length = request.word_length != 0 ? request.word_length : WORD_LENGTH;
+    StartReply reply;
 
     // Kiểm tra nếu người chơi là Player 1
     if (client_sock == get_player_sock(player1_name))
@@ -767,24 +2335,38 @@ void handle_message(int client_sock, Message *message)
         printf("Game session found with ID %d between %s and %s\n", session_id, player1_name, player2_name);
         message->status = SUCCESS;
         GameSession *session = &game_sessions[session_id];
-        int player_num = (strcmp(player1_name, session->player1_name) == 0) ? 1 : 2;
-        sprintf(message->payload, "%d|%d", session_id, player_num);
+        reply.session_id = session_id;
+        reply.player_num = session_player_num(session, player1_name) == 1 ? 1 : 2;
+        encode_start_reply(message, &reply);
       }
       else
       {
         printf("Creating game session between %s and %s\n", player1_name, player2_name);
-        session_id = create_game_session(player1_name, player2_name);
-        if (session_id != -1)
+        char error[64];
+        snprintf(error, sizeof(error), "No dictionary for %d-letter words", word_length);
+        if (word_length < MIN_WORD_LENGTH || word_length > MAX_WORD_LENGTH)
+        {
+          message_set_text(message, BAD_REQUEST, error);
+        }
+        else if (atomic_load(&draining))
+        {
+          message_set_text(message, SERVICE_UNAVAILABLE, "Server is restarting, try again shortly");
+        }
+        else if ((session_id = create_game_session(player1_name, player2_name, word_length)) == NO_DICTIONARY)
+        {
+          message_set_text(message, BAD_REQUEST, error);
+        }
+        else if (session_id != -1)
         {
           message->status = SUCCESS;
           GameSession *session = &game_sessions[session_id];
-          int player_num = (strcmp(player1_name, session->player1_name) == 0) ? 1 : 2;
-          sprintf(message->payload, "%d|%d", session_id, player_num);
+          reply.session_id = session_id;
+          reply.player_num = session_player_num(session, player1_name) == 1 ? 1 : 2;
+          encode_start_reply(message, &reply);
         }
         else
         {
-          message->status = INTERNAL_SERVER_ERROR;
-          strcpy(message->payload, "Failed to create game session");
+          admission_refuse(message, ADMIT_SESSION); // Quá giới hạn session: báo client thử lại sau
         }
       }
     }
@@ -795,125 +2377,165 @@ void handle_message(int client_sock, Message *message)
       if (session_id != -1)
       {
         message->status = SUCCESS;
-        sprintf(message->payload, "%d", session_id);
+        reply.session_id = session_id;
+        reply.player_num = session_player_num(&game_sessions[session_id], player2_name) == 1 ? 1 : 2;
+        encode_start_reply(message, &reply);
       }
       else
       {
-        message->status = BAD_REQUEST;
-        strcpy(message->payload, "Game not found");
+        message_set_text(message, BAD_REQUEST, "Game not found");
       }
     }
+    else
+    {
+      message_set_text(message, BAD_REQUEST, "Player not found");
+    }
     // Gửi phản hồi cho cả hai người chơi
-    send(client_sock, message, sizeof(Message), 0);
+    send_message(client_sock, message);
     break;
   }
   case GAME_GET_TARGET:
   {
-    int session_id;
-    sscanf(message->payload, "%d", &session_id);
+    int session_id = message_session_id(message);
 
     if (session_id >= 0 && session_id < MAX_SESSIONS && game_sessions[session_id].game_active)
     {
       // --- SỬA ĐỔI: Tạo từ xáo trộn ---
-      char hint_word[WORD_LENGTH + 1];
+      char hint_word[MAX_WORD_LENGTH + 1];
       strcpy(hint_word, game_sessions[session_id].last_word);
       scramble_string(hint_word); // Xáo trộn
 
       // Gửi từ xáo trộn cho Client
-      strcpy(message->payload, hint_word);
+      encode_word(message, hint_word);
       message->status = SUCCESS;
     }
     else
     {
-      strcpy(message->payload, "Invalid session");
-      message->status = INTERNAL_SERVER_ERROR;
+      message_set_text(message, INTERNAL_SERVER_ERROR, "Invalid session");
+    }
+    send_message(client_sock, message);
+    break;
+  }
+  case GAME_HINT:
+  {
+    // HintRequest -> HintReply: k từ tốt nhất kèm score
+    // score = số từ chưa dùng đối thủ còn có thể nối sau từ đó (càng thấp càng tốt)
+    HintRequest request;
+    if (decode_hint_request(message, &request) < 0)
+      request.session_id = -1;
+    int session_id = request.session_id, k = request.count;
+    const char *player_name = request.player;
+
+    if (session_id < 0 || session_id >= MAX_SESSIONS || !game_sessions[session_id].game_active ||
+        session_sender_num(&game_sessions[session_id], player_name, client_sock) == 0)
+    {
+      message_set_text(message, BAD_REQUEST, "Invalid session");
+      send_message(client_sock, message);
+      break;
+    }
+    if (k < 1 || k > MAX_HINTS)
+      k = DEFAULT_HINTS;
+
+    GameSession *session = &game_sessions[session_id];
+    int first_letter = session->current_attempts > 0 ? word_key_last(session->last_key) : -1;
+    uint32_t hints[MAX_HINTS];
+    int scores[MAX_HINTS];
+    int count = dict_rank_replies(session->dictionary, first_letter, session->used_words,
+                                  session->remaining_by_letter, hints, scores, k);
+
+    if (count == 0)
+    {
+      message_set_text(message, NOT_FOUND, "No legal reply left");
+      send_message(client_sock, message);
+      break;
+    }
+    HintReply reply;
+    reply.count = (uint8_t)count;
+    for (int i = 0; i < count; i++)
+    {
+      dict_unpack(session->dictionary, hints[i], reply.words[i]);
+      reply.scores[i] = (uint16_t)scores[i];
     }
-    send(client_sock, message, sizeof(Message), 0);
+    message->status = SUCCESS;
+    encode_hint_reply(message, &reply);
+    send_message(client_sock, message);
     break;
   }
   case GAME_GUESS:
   {
-    int session_id;
-    char guess[WORD_LENGTH + 1];
-    char player_name[50];
-    sscanf(message->payload, "%d|%49[^|]|%49s", &session_id, player_name, guess);
+    // guess đủ chỗ cho input dài, is_valid_guess() sẽ loại từ sai độ dài
+    GuessRequest request;
+    if (decode_guess_request(message, &request) < 0)
+      request.session_id = -1;
+    int session_id = request.session_id;
+    const char *player_name = request.player, *guess = request.word;
+
+    if (session_id < 0 || session_id >= MAX_SESSIONS || !game_sessions[session_id].game_active)
+    {
+      message_set_text(message, BAD_REQUEST, "Invalid session");
+      send_message(client_sock, message);
+      return;
+    }
 
     GameSession *session = &game_sessions[session_id];
-    int player_num = (strcmp(player_name, session->player1_name) == 0) ? 1 : 2;
+    int player_num = session_sender_num(session, player_name, client_sock);
+    if (player_num == 0)
+    {
+      message_set_text(message, BAD_REQUEST, "Not a player of this game");
+      send_message(client_sock, message);
+      return;
+    }
 
     // 1. Kiểm tra lượt
     if (player_num != session->current_player)
     {
-      strcpy(message->payload, "Not your turn");
-      message->status = BAD_REQUEST;
-      send(client_sock, message, sizeof(Message), 0);
+      message_set_text(message, BAD_REQUEST, "Not your turn");
+      send_message(client_sock, message);
       return;
     }
 
-    // 2. Kiểm tra thời gian (Timeout)
-    if (session->current_attempts > 0)
-    {
-      time_t now = time(NULL);
-      if (difftime(now, session->last_move_time) > 12.0)
-      {
-        message->status = SUCCESS;
-        sprintf(message->payload, "TIMEOUT_LOSE|%s", player_name);
-        int s1 = get_player_sock(session->player1_name);
-        int s2 = get_player_sock(session->player2_name);
-        if (s1 != -1)
-          send(s1, message, sizeof(Message), 0);
-        if (s2 != -1)
-          send(s2, message, sizeof(Message), 0);
-        clear_game_session(session_id);
-        return;
-      }
-    }
+    // 2. Hết giờ do turn_timers[session_id] xử lý ngay khi tới hạn
 
     // 3. KIỂM TRA TỪ CÓ TRONG TỪ ĐIỂN KHÔNG (QUAN TRỌNG)
-    if (!is_valid_guess(guess))
+    uint32_t guess_key = dict_pack(session->dictionary, guess); // 0 nếu không đúng word_length chữ cái thường
+    int word_index = is_valid_guess(session->dictionary, guess_key); // Thế hệ từ điển của session
+    if (word_index == -1)
     {
-      strcpy(message->payload, "Invalid word (Not in dictionary)!");
-      message->status = BAD_REQUEST;
-      send(client_sock, message, sizeof(Message), 0);
+      char suggestions[64], error[128];
+      format_suggestions(session, guess, suggestions, sizeof(suggestions));
+      snprintf(error, sizeof(error), "Invalid word (Not in dictionary)!%s", suggestions);
+      message_set_text(message, BAD_REQUEST, error);
+      send_message(client_sock, message);
       return; // Dừng ngay nếu từ không hợp lệ
     }
 
     // 4. Kiểm tra từ đã dùng chưa (Duplicate)
-    int is_duplicate = 0;
-    for (int i = 0; i < session->current_attempts; i++)
-    {
-      if (strcmp(session->turns[i].guess, guess) == 0)
-      {
-        is_duplicate = 1;
-        break;
-      }
-    }
-    if (is_duplicate)
+    if (word_set_test(session->used_words, word_index))
     {
-      strcpy(message->payload, "Word already used!");
-      message->status = BAD_REQUEST;
-      send(client_sock, message, sizeof(Message), 0);
+      message_set_text(message, BAD_REQUEST, "Word already used!");
+      send_message(client_sock, message);
       return;
     }
 
     // 5. Kiểm tra luật nối từ (Ký tự đầu trùng ký tự cuối)
     if (session->current_attempts > 0)
     {
-      char required_char = session->last_word[WORD_LENGTH - 1];
-      if (guess[0] != required_char)
+      int required_letter = word_key_last(session->last_key);
+      if (dict_key_first(session->dictionary, guess_key) != required_letter)
       {
         char err_msg[100];
-        sprintf(err_msg, "Word must start with '%c'", required_char);
-        strcpy(message->payload, err_msg);
-        message->status = BAD_REQUEST;
-        send(client_sock, message, sizeof(Message), 0);
+        sprintf(err_msg, "Word must start with '%c'", 'a' + required_letter);
+        message_set_text(message, BAD_REQUEST, err_msg);
+        send_message(client_sock, message);
         return;
       }
     }
 
     // --- HỢP LỆ ---
     strcpy(session->last_word, guess);
+    session->last_key = guess_key;
     session->last_move_time = time(NULL);
+    event_loop_timer_start(&turn_timers[session_id], TURN_TIMEOUT_MS); // Hạn lượt của người kế tiếp
 
     if (player_num == 1)
       session->player1_score += 10;
@@ -922,32 +2544,38 @@ void handle_message(int client_sock, Message *message)
 
     session->current_player = (player_num == 1) ? 2 : 1;
 
-    strcpy(session->turns[session->current_attempts].player_name, player_name);
-    strcpy(session->turns[session->current_attempts].guess, guess);
-    strcpy(session->turns[session->current_attempts].result, "VALID");
+    if (session->current_attempts < MAX_TURNS)
+    {
+      session->turns[session->current_attempts].player = (uint8_t)player_num;
+      strcpy(session->turns[session->current_attempts].guess, guess);
+    }
+    word_set_add(session->used_words, word_index);
+    session->remaining_by_letter[dict_key_first(session->dictionary, guess_key)]--;
     session->current_attempts++;
 
-    sprintf(message->payload, "CONTINUE|%d|%s|%d|%d",
-            session->current_player, session->last_word,
-            session->player1_score, session->player2_score);
+    GuessReply reply = {.outcome = GUESS_CONTINUE,
+                        .next_player = (uint8_t)session->current_player,
+                        .player1_score = session->player1_score,
+                        .player2_score = session->player2_score};
+    strcpy(reply.word, session->last_word);
     message->status = SUCCESS;
+    encode_guess_reply(message, &reply);
 
-    int s1 = get_player_sock(session->player1_name);
-    int s2 = get_player_sock(session->player2_name);
-    if (s1 != -1)
-      send(s1, message, sizeof(Message), 0);
-    if (s2 != -1)
-      send(s2, message, sizeof(Message), 0);
+    send_to_players(session, message);
 
+    // 6. Người đi tiếp không còn từ nào bắt đầu bằng chữ cuối: thua ngay, không chờ hết giờ
+    if (session->remaining_by_letter[word_key_last(guess_key)] == 0)
+    {
+      printf("No words left starting with '%c' in session %d\n", 'a' + word_key_last(guess_key), session_id);
+      end_game_by_timeout(session_id, session->current_player);
+    }
     break;
   }
   case GAME_UPDATE:
   {
-    printf("Received game update\n");
-    printf("Payload: %s\n", message->payload);
-    int session_id;
-    char player_name[50];
-    sscanf(message->payload, "%d|%49s", &session_id, player_name);
+    SessionRequest request;
+    if (decode_session_request(message, &request) == 0)
+      printf("Received game update for session %d from %s\n", request.session_id, request.player);
     break;
   }
   case LIST_GAME_HISTORY:
@@ -1002,7 +2630,7 @@ void handle_message(int client_sock, Message *message)
       strcpy(message->payload, "Internal server error occurred.");
     }
 
-    send(client_sock, message, sizeof(Message), 0);
+    send_message(client_sock, message);
     break;
   }
   case GAME_DETAIL_REQUEST:
@@ -1043,39 +2671,32 @@ void handle_message(int client_sock, Message *message)
       message->status = SUCCESS;
     }
 
-    send(client_sock, message, sizeof(Message), 0);
+    send_message(client_sock, message);
     break;
   }
   case GAME_END:
   {
-    printf("Received game end\n");
-    printf("Payload: %s\n", message->payload);
-    int session_id;
-    char player_name[50];
-    sscanf(message->payload, "%d|%s", &session_id, player_name);
+    SessionRequest request;
+    if (decode_session_request(message, &request) < 0 || request.session_id < 0 || request.session_id >= MAX_SESSIONS)
+      break;
+    int session_id = request.session_id;
+    const char *player_name = request.player;
+    printf("Received game end for session %d from %s\n", session_id, player_name);
     GameSession *session = &game_sessions[session_id];
-    if (strcmp(player_name, session->player1_name) == 0 || strcmp(player_name, session->player2_name) == 0)
+    int player_num = session->game_active ? session_sender_num(session, player_name, client_sock) : 0;
+    if (player_num != 0)
     {
       session->game_active = 0;
       // Send a final turn update to both players
       Message turn_message;
       turn_message.message_type = GAME_TURN;
-      sprintf(turn_message.payload, "%d", 0);
+      encode_turn(&turn_message, 0);
       turn_message.status = SUCCESS;
-      send(get_player_sock(session->player1_name), &turn_message, sizeof(Message), 0);
-      send(get_player_sock(session->player2_name), &turn_message, sizeof(Message), 0);
+      send_to_players(session, &turn_message);
       get_time_as_string(session->end_time, sizeof(session->end_time));
       // Update score for player win
       User user;
-      char win_player[50];
-      if (strcmp(player_name, session->player1_name) == 0)
-      {
-        strcpy(win_player, session->player2_name);
-      }
-      else
-      {
-        strcpy(win_player, session->player1_name);
-      }
+      const char *win_player = player_id_name(player_num == 1 ? session->player2_id : session->player1_id);
       int get_user = get_user_by_username(db, win_player, &user);
       if (get_user == SQLITE_OK)
       {
@@ -1097,46 +2718,22 @@ void handle_message(int client_sock, Message *message)
       }
 
       Message end_message;
+      EndNotice notice = {.reason = END_ABANDONED, .score_change = 0};
+      strcpy(notice.player, player_name);
       end_message.message_type = GAME_END;
       end_message.status = SUCCESS;
-      sprintf(end_message.payload, "%s", player_name);
-      send(get_player_sock(session->player1_name), &end_message, sizeof(Message), 0);
-      send(get_player_sock(session->player2_name), &end_message, sizeof(Message), 0);
+      encode_end_notice(&end_message, &notice);
+      send_to_players(session, &end_message);
 
       // Save game history
       GameHistory game_history;
-      strcpy(game_history.game_id, session->game_id);
-      strcpy(game_history.player1, session->player1_name);
-      strcpy(game_history.player2, session->player2_name);
+      fill_game_history(session, &game_history); // Kèm các nước đi của session
       strcpy(game_history.word, session->last_word);
       game_history.player1_score = session->player1_score;
       game_history.player2_score = session->player2_score;
-
-      if (strcmp(player_name, session->player1_name) == 0)
-      {
-        strcpy(game_history.winner, session->player2_name);
-      }
-      else
-      {
-        strcpy(game_history.winner, session->player1_name);
-      }
-
-      strcpy(game_history.start_time, session->start_time);
+      strcpy(game_history.winner, win_player);
       strcpy(game_history.end_time, session->end_time);
 
-      // Copy the turns from GameSession to GameHistory
-      for (int i = 0; i < MAX_ATTEMPTS; i++)
-      {
-        if (strlen(session->turns[i].guess) == 0)
-        {
-          break;
-        }
-
-        strcpy(game_history.moves[i].player_name, session->turns[i].player_name);
-        strcpy(game_history.moves[i].guess, session->turns[i].guess);
-        strcpy(game_history.moves[i].result, session->turns[i].result);
-      }
-
       // Save game history and moves to the database
       int rc = save_game_history(db, &game_history);
       if (rc != SQLITE_OK)
@@ -1154,95 +2751,33 @@ void handle_message(int client_sock, Message *message)
   }
   case GAME_TIMEOUT:
   {
-    int session_id;
-    char loser_name[50];
-    sscanf(message->payload, "%d|%49s", &session_id, loser_name);
-
-    GameSession *session = &game_sessions[session_id];
-    if (!session->game_active)
-      break;
-
-    // Xác định người thắng
-    char winner_name[50];
-    int winner_sock, loser_sock;
-    int loser_num; // 1 hoặc 2
-
-    if (strcmp(loser_name, session->player1_name) == 0)
+    // Hạn lượt do turn_timers xử lý; client chỉ còn dùng message này để tự
+    // nhận thua khi hết giờ lượt của mình, nên người thua là người gửi (tên
+    // phải là của chính họ) và chỉ khi đang tới lượt họ
+    SessionRequest request;
+    if (decode_session_request(message, &request) < 0)
+      request.session_id = -1;
+    int session_id = request.session_id;
+    int player_num = session_id >= 0 && session_id < MAX_SESSIONS && game_sessions[session_id].game_active
+                         ? session_sender_num(&game_sessions[session_id], request.player, client_sock)
+                         : 0;
+    if (player_num == 0)
     {
-      strcpy(winner_name, session->player2_name);
-      loser_sock = get_player_sock(session->player1_name);
-      winner_sock = get_player_sock(session->player2_name);
-      loser_num = 1;
-    }
-    else
-    {
-      strcpy(winner_name, session->player1_name);
-      loser_sock = get_player_sock(session->player2_name);
-      winner_sock = get_player_sock(session->player1_name);
-      loser_num = 2;
-    }
-
-    // --- TÍNH ĐIỂM (Càng thắng nhanh càng nhiều điểm) ---
-    // Công thức: 50 điểm gốc + (200 / số lượt).
-    int turns = (session->current_attempts > 0) ? session->current_attempts : 1;
-    int score_change = 50 + (200 / turns);
-
-    // Cập nhật DB
-    User winner_user, loser_user;
-    if (get_user_by_username(db, winner_name, &winner_user) == SQLITE_OK)
-    {
-      update_user_score(db, winner_name, winner_user.score + score_change);
-    }
-    if (get_user_by_username(db, loser_name, &loser_user) == SQLITE_OK)
-    {
-      int new_score = (loser_user.score - score_change < 0) ? 0 : (loser_user.score - score_change);
-      update_user_score(db, loser_name, new_score);
-    }
-
-    // Gửi kết quả
-    Message end_msg;
-    end_msg.message_type = GAME_END;
-    end_msg.status = SUCCESS;
-    // Payload: WINNER_NAME | SCORE_CHANGE
-    sprintf(end_msg.payload, "%s|%d", winner_name, score_change);
-
-    if (winner_sock != -1)
-      send(winner_sock, &end_msg, sizeof(Message), 0);
-    if (loser_sock != -1)
-      send(loser_sock, &end_msg, sizeof(Message), 0);
-
-    // Lưu lịch sử và dọn dẹp
-    session->game_active = 0;
-
-    GameHistory game_history;
-    strcpy(game_history.game_id, session->game_id);
-    strcpy(game_history.player1, session->player1_name);
-    strcpy(game_history.player2, session->player2_name);
-    strcpy(game_history.winner, winner_name);
-    game_history.player1_score = (loser_num == 2) ? score_change : 0;
-    game_history.player2_score = (loser_num == 1) ? score_change : 0;
-
-    get_time_as_string(game_history.end_time, sizeof(game_history.end_time));
-    strcpy(game_history.start_time, session->start_time);
-    strcpy(game_history.word, "TIMEOUT");
-
-    // Copy moves (tối đa 12)
-    for (int i = 0; i < 12; i++)
-    {
-      if (i >= session->current_attempts)
-        break;
-      game_history.moves[i] = session->turns[i];
+      message_set_text(message, BAD_REQUEST, "Invalid session");
+      send_message(client_sock, message);
+      break;
     }
-
-    save_game_history(db, &game_history);
-    clear_game_session(session_id);
+    if (player_num != game_sessions[session_id].current_player)
+      break; // Đồng hồ client lệch với server: bỏ qua, turn_timers vẫn giữ hạn lượt
+    printf("Player %d forfeits session %d\n", player_num, session_id);
+    end_game_by_timeout(session_id, player_num);
     break;
   }
   default:
   {
     message->status = BAD_REQUEST;
     strcpy(message->payload, "Invalid message type");
-    send(client_sock, message, sizeof(Message), 0);
+    send_message(client_sock, message);
     break;
   }
   }
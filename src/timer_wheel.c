@@ -0,0 +1,167 @@
+#include <stddef.h>
+#include "timer_wheel.h"
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+
+void timer_wheel_init(TimerWheel *wheel, uint64_t now)
+{
+  wheel->now = now;
+  wheel->count = 0;
+  for (int level = 0; level < TIMER_LEVELS; level++)
+  {
+    wheel->occupied[level] = 0;
+    for (int slot = 0; slot < TIMER_SLOTS; slot++)
+      wheel->slots[level][slot].next = wheel->slots[level][slot].prev = &wheel->slots[level][slot];
+  }
+}
+
+// Slot lists are circular with the slot itself as the head
+static void link_append(TimerLink *head, TimerLink *link)
+{
+  link->prev = head->prev;
+  link->next = head;
+  head->prev->next = link;
+  head->prev = link;
+}
+
+static void link_remove(TimerLink *link)
+{
+  link->prev->next = link->next;
+  link->next->prev = link->prev;
+  link->next = link->prev = NULL;
+}
+
+// Level by distance to the deadline: level L holds deadlines less than
+// 64^(L + 1) ticks away, in the slot matching their level-L digit
+static void place(TimerWheel *wheel, Timer *timer)
+{
+  uint64_t delta = timer->expires - wheel->now;
+  int level = 0;
+  while (level < TIMER_LEVELS - 1 && delta >> (TIMER_LEVEL_BITS * (level + 1)) != 0)
+    level++;
+  int slot = (int)((timer->expires >> (TIMER_LEVEL_BITS * level)) & SLOT_MASK);
+
+  link_append(&wheel->slots[level][slot], &timer->link);
+  wheel->occupied[level] |= (uint64_t)1 << slot;
+  timer->level = level;
+  timer->slot = slot;
+}
+
+void timer_wheel_add(TimerWheel *wheel, Timer *timer, uint64_t expires)
+{
+  if (expires < wheel->now)
+    expires = wheel->now;
+  if (expires - wheel->now > TIMER_MAX_DELAY)
+    expires = wheel->now + TIMER_MAX_DELAY;
+  timer->expires = expires;
+  place(wheel, timer);
+  wheel->count++;
+}
+
+// A timer cancelled while its slot is being run is on that run's own list;
+// the slot may have new timers by then, so its bit is only cleared if empty.
+void timer_wheel_cancel(TimerWheel *wheel, Timer *timer)
+{
+  if (!timer_pending(timer))
+    return;
+  link_remove(&timer->link);
+  TimerLink *head = &wheel->slots[timer->level][timer->slot];
+  if (head->next == head)
+    wheel->occupied[timer->level] &= ~((uint64_t)1 << timer->slot);
+  wheel->count--;
+}
+
+// Move every timer of one upper-level slot down, now that it has come round
+static void cascade(TimerWheel *wheel, int level, int slot)
+{
+  TimerLink *head = &wheel->slots[level][slot];
+  wheel->occupied[level] &= ~((uint64_t)1 << slot);
+  while (head->next != head)
+  {
+    Timer *timer = (Timer *)head->next;
+    link_remove(&timer->link);
+    place(wheel, timer);
+  }
+}
+
+static int lowest_bit(uint64_t bits)
+{
+  return __builtin_ctzll(bits);
+}
+
+uint64_t timer_wheel_next(const TimerWheel *wheel)
+{
+  uint64_t next = UINT64_MAX;
+  if (wheel->count == 0)
+    return next;
+
+  for (int level = 0; level < TIMER_LEVELS; level++)
+  {
+    uint64_t occupied = wheel->occupied[level];
+    if (occupied == 0)
+      continue;
+    int shift = TIMER_LEVEL_BITS * level;
+    uint64_t position = wheel->now >> shift;
+    int current = (int)(position & SLOT_MASK);
+
+    // Bit 0 = the slot at the current position. It is due now if the slot
+    // boundary has not been run yet, otherwise it only comes round again
+    // after a full turn.
+    uint64_t ahead = current == 0 ? occupied : (occupied >> current) | (occupied << (TIMER_SLOTS - current));
+    if (wheel->now & (((uint64_t)1 << shift) - 1))
+      ahead &= ~(uint64_t)1;
+    int distance = ahead != 0 ? lowest_bit(ahead) : TIMER_SLOTS;
+
+    uint64_t tick = (position + distance) << shift;
+    if (tick < next)
+      next = tick;
+  }
+  return next;
+}
+
+void timer_wheel_advance(TimerWheel *wheel, uint64_t now)
+{
+  while (wheel->count > 0)
+  {
+    // Ticks in between have nothing queued and no slot to cascade
+    uint64_t tick = timer_wheel_next(wheel);
+    if (tick > now)
+      break;
+    wheel->now = tick;
+
+    for (int level = 1; level < TIMER_LEVELS; level++)
+    {
+      int shift = TIMER_LEVEL_BITS * level;
+      if (tick & (((uint64_t)1 << shift) - 1))
+        break;
+      cascade(wheel, level, (int)((tick >> shift) & SLOT_MASK));
+    }
+
+    // Detach the due slot first: callbacks may add timers for later ticks
+    int slot = (int)(tick & SLOT_MASK);
+    TimerLink *head = &wheel->slots[0][slot];
+    TimerLink due;
+    if (head->next == head)
+    {
+      wheel->now = tick + 1;
+      continue;
+    }
+    due.next = head->next;
+    due.prev = head->prev;
+    due.next->prev = &due;
+    due.prev->next = &due;
+    head->next = head->prev = head;
+    wheel->occupied[0] &= ~((uint64_t)1 << slot);
+    wheel->now = tick + 1;
+
+    while (due.next != &due)
+    {
+      Timer *timer = (Timer *)due.next;
+      link_remove(&timer->link);
+      wheel->count--;
+      timer->callback(timer);
+    }
+  }
+  if (wheel->now <= now)
+    wheel->now = now + 1;
+}
@@ -0,0 +1,53 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+// Hierarchical timing wheel with 1 ms ticks. Level L has 64 slots of 64^L
+// ticks each, so four levels reach 2^24 ms (about 4.6 hours); later deadlines
+// are clamped to that. A pending timer sits on exactly one slot's list, so
+// adding, cancelling and expiring it are O(1). Timers in an upper level only
+// move down when their slot comes round, and nothing scans idle slots.
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS 4
+#define TIMER_MAX_DELAY (((uint64_t)1 << (TIMER_LEVEL_BITS * TIMER_LEVELS)) - 1)
+
+typedef struct TimerLink
+{
+  struct TimerLink *next; // NULL when the timer is not pending
+  struct TimerLink *prev;
+} TimerLink;
+
+typedef struct Timer
+{
+  TimerLink link;   // First member: slot lists hold &timer->link
+  uint64_t expires; // Tick the timer is due
+  void (*callback)(struct Timer *timer);
+  int level; // Slot it was last queued on
+  int slot;
+} Timer;
+
+typedef struct
+{
+  uint64_t now;                    // Next tick to run
+  uint64_t occupied[TIMER_LEVELS]; // Bit s set when slots[level][s] is not empty
+  TimerLink slots[TIMER_LEVELS][TIMER_SLOTS];
+  int count; // Pending timers
+} TimerWheel;
+
+void timer_wheel_init(TimerWheel *wheel, uint64_t now);
+// Queue timer to run at tick expires (now if that has passed); it must not be pending
+void timer_wheel_add(TimerWheel *wheel, Timer *timer, uint64_t expires);
+void timer_wheel_cancel(TimerWheel *wheel, Timer *timer);
+// Run, in tick order, the callback of every timer due at or before tick now
+void timer_wheel_advance(TimerWheel *wheel, uint64_t now);
+// First tick at which timer_wheel_advance has work; UINT64_MAX when empty
+uint64_t timer_wheel_next(const TimerWheel *wheel);
+
+static inline int timer_pending(const Timer *timer)
+{
+  return timer->link.next != NULL;
+}
+
+#endif
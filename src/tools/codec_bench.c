@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../model/message.h"
+
+// Per-move cost of the GAME_GUESS round trip on the server: parse the request,
+// build the CONTINUE reply and frame it. "text" is the old sprintf/sscanf
+// payload, "binary" the model/message.c codec.
+// Usage: ./codec_bench [iterations]
+
+static volatile int sink; // Keeps the compiler from dropping the work
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+  return (double)(end->tv_sec - start->tv_sec) * 1e9 + (double)(end->tv_nsec - start->tv_nsec);
+}
+
+static void bench_text(long iterations, Message *request, char *frame)
+{
+  snprintf(request->payload, sizeof(request->payload), "%d|%s|%s", 17, "ShadowHunter", "apple");
+  request->message_type = LIST_USER; // Any text message type: framed up to its NUL
+
+  struct timespec start, end;
+  size_t bytes = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (long i = 0; i < iterations; i++)
+  {
+    Message message = *request;
+    int session_id;
+    char player_name[50], guess[50];
+    sscanf(message.payload, "%d|%49[^|]|%49s", &session_id, player_name, guess);
+    sprintf(message.payload, "CONTINUE|%d|%s|%d|%d", 2, guess, 10 * session_id, 20);
+    bytes = message_encode(&message, frame);
+    sink += frame[bytes - 1];
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("text:   %6.1f ns/message, reply %zu bytes on the wire\n", elapsed_ns(&start, &end) / iterations, bytes);
+}
+
+static void bench_binary(long iterations, Message *request, char *frame)
+{
+  GuessRequest guess_request = {.session_id = 17};
+  strcpy(guess_request.player, "ShadowHunter");
+  strcpy(guess_request.word, "apple");
+  request->message_type = GAME_GUESS;
+  encode_guess_request(request, &guess_request);
+
+  struct timespec start, end;
+  size_t bytes = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (long i = 0; i < iterations; i++)
+  {
+    Message message = *request;
+    GuessRequest parsed;
+    decode_guess_request(&message, &parsed);
+    GuessReply reply = {.outcome = GUESS_CONTINUE, .next_player = 2,
+                        .player1_score = 10 * parsed.session_id, .player2_score = 20};
+    strcpy(reply.word, parsed.word);
+    encode_guess_reply(&message, &reply);
+    bytes = message_encode(&message, frame);
+    sink += frame[bytes - 1];
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("binary: %6.1f ns/message, reply %zu bytes on the wire\n", elapsed_ns(&start, &end) / iterations, bytes);
+}
+
+int main(int argc, char *argv[])
+{
+  long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+  if (iterations <= 0)
+    iterations = 1000000;
+
+  Message request;
+  char frame[MESSAGE_MAX_FRAME];
+  memset(&request, 0, sizeof(request));
+  bench_text(iterations, &request, frame);
+  bench_binary(iterations, &request, frame);
+  return 0;
+}
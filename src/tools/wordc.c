@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../dictionary.h"
+
+// Compile a text word list into the binary index the server maps at startup.
+// Usage: ./wordc [-l length] [valid_words.txt] [valid_words.bin]
+// Lengths other than 5 are served from valid_wordsN.txt / valid_wordsN.bin.
+int main(int argc, char *argv[])
+{
+  int length = WORD_LENGTH;
+  int arg = 1;
+  if (argc > 2 && strcmp(argv[1], "-l") == 0)
+  {
+    length = atoi(argv[2]);
+    arg = 3;
+  }
+  if (word_engine_for(length) == NULL)
+  {
+    fprintf(stderr, "Word length must be %d-%d\n", MIN_WORD_LENGTH, MAX_WORD_LENGTH);
+    return 1;
+  }
+  const char *input = argc > arg ? argv[arg] : "valid_words.txt";
+  const char *output = argc > arg + 1 ? argv[arg + 1] : "valid_words.bin";
+
+  Dictionary dict;
+  if (dict_load_text(&dict, input, length) <= 0)
+  {
+    fprintf(stderr, "No words loaded from %s\n", input);
+    return 1;
+  }
+
+  if (dict_write_binary(&dict, output) != 0)
+  {
+    dict_free(&dict);
+    return 1;
+  }
+
+  const WordIndexHeader *header = dict.storage;
+  printf("Compiled %d %d-letter words into %s (%zu bytes, %u slots, checksum %08x)\n",
+         dict.count, length, output, dict.storage_size, header->slot_count, header->checksum);
+  for (int l = 0; l < ALPHABET_SIZE; l++)
+  {
+    printf("%c:%d%c", 'a' + l, dict_count_starting_with(&dict, l), l == ALPHABET_SIZE - 1 ? '\n' : ' ');
+  }
+  dict_free(&dict);
+  return 0;
+}
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../dictionary.h"
+#include "../word_kernels.h"
+
+// Checks the fast paths against their reference implementations:
+// dict_contains against dict_contains_linear, and every word_find /
+// word_distances implementation the CPU runs against the scalar loop.
+// Usage: ./wordcheck [-l length] [valid_words.txt]   (run by `make check`)
+
+#define RANDOM_WORDS 200000
+#define RANDOM_ROUNDS 2000
+#define MAX_KEYS 300
+
+static int failures;
+
+static void check_word(const Dictionary *dict, const char *word, int expected)
+{
+  int fast = dict_contains(dict, word);
+  int linear = dict_contains_linear(dict, word);
+  if (fast != linear || (expected >= 0 && fast != expected))
+  {
+    if (failures++ < 10)
+      fprintf(stderr, "dict_contains(\"%s\") = %d, linear = %d\n", word, fast, linear);
+  }
+}
+
+static int check_dictionary(const char *filename, int length)
+{
+  Dictionary dict;
+  if (dict_load_text(&dict, filename, length) <= 0)
+  {
+    fprintf(stderr, "No words loaded from %s\n", filename);
+    return -1;
+  }
+
+  // Every listed word, then the same word with one letter changed
+  char word[64];
+  FILE *file = fopen(filename, "r");
+  if (file == NULL)
+  {
+    perror("Error opening file");
+    dict_free(&dict);
+    return -1;
+  }
+  int checked = 0;
+  while (fscanf(file, "%63s", word) == 1)
+  {
+    int listed = dict.engine->pack(word) != 0;
+    check_word(&dict, word, listed);
+    if (listed)
+    {
+      word[checked % length] = 'a' + (word[checked % length] - 'a' + 1) % ALPHABET_SIZE;
+      check_word(&dict, word, -1);
+    }
+    checked++;
+  }
+  fclose(file);
+
+  // Random letters (mostly not words), and strings that never pack
+  for (int i = 0; i < RANDOM_WORDS; i++)
+  {
+    for (int j = 0; j < length; j++)
+      word[j] = 'a' + rand() % ALPHABET_SIZE;
+    word[length] = '\0';
+    check_word(&dict, word, -1);
+  }
+  const char *invalid[] = {"", "a", "ABCDE", "abc1e", "abcdefghij", "ab cd"};
+  for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++)
+    check_word(&dict, invalid[i], 0);
+
+  printf("dictionary: %d words of length %d, %d listed checked\n", dict.count, length, checked);
+  dict_free(&dict);
+  return 0;
+}
+
+static uint32_t random_key(int length)
+{
+  uint32_t key = 0;
+  for (int j = 0; j < length; j++)
+    key = (key << LETTER_BITS) | (uint32_t)(1 + rand() % ALPHABET_SIZE);
+  return key;
+}
+
+static void check_kernels(int length)
+{
+  const WordKernels *kernels;
+  int count = word_kernels_list(&kernels);
+  uint32_t field_low_bits = (uint32_t)(((1ull << (LETTER_BITS * length)) - 1) / LETTER_MASK);
+  uint32_t keys[MAX_KEYS];
+  uint8_t expected[MAX_KEYS], distances[MAX_KEYS];
+
+  for (int round = 0; round < RANDOM_ROUNDS; round++)
+  {
+    // Odd sizes exercise the scalar tails after the vector loops
+    int n = rand() % MAX_KEYS;
+    for (int i = 0; i < n; i++)
+      keys[i] = random_key(length);
+    uint32_t key = random_key(length);
+    if (n > 0 && round % 2 == 0)
+      key = keys[rand() % n]; // Present, maybe more than once
+    if (n > 0 && round % 8 == 0)
+      keys[n - 1] = key; // Last lane
+
+    int found = kernels[0].find(keys, n, key);
+    kernels[0].distances(keys, n, key, field_low_bits, expected);
+    for (int k = 1; k < count; k++)
+    {
+      int index = kernels[k].find(keys, n, key);
+      memset(distances, 0xFF, sizeof(distances));
+      kernels[k].distances(keys, n, key, field_low_bits, distances);
+      if (index != found || memcmp(distances, expected, n) != 0)
+      {
+        if (failures++ < 10)
+          fprintf(stderr, "%s: find = %d (scalar %d) or distances differ, %d keys\n", kernels[k].name, index, found, n);
+      }
+    }
+  }
+
+  printf("kernels:");
+  for (int k = 0; k < count; k++)
+    printf(" %s", kernels[k].name);
+  printf(" (%d rounds)\n", RANDOM_ROUNDS);
+}
+
+int main(int argc, char *argv[])
+{
+  int length = WORD_LENGTH;
+  int arg = 1;
+  if (argc > 2 && strcmp(argv[1], "-l") == 0)
+  {
+    length = atoi(argv[2]);
+    arg = 3;
+  }
+  if (word_engine_for(length) == NULL)
+  {
+    fprintf(stderr, "Word length must be %d-%d\n", MIN_WORD_LENGTH, MAX_WORD_LENGTH);
+    return 1;
+  }
+  const char *input = argc > arg ? argv[arg] : "valid_words.txt";
+
+  srand(1);
+  if (check_dictionary(input, length) < 0)
+    return 1;
+  check_kernels(length);
+
+  if (failures > 0)
+  {
+    fprintf(stderr, "%d mismatches\n", failures);
+    return 1;
+  }
+  printf("OK\n");
+  return 0;
+}
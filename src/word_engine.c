@@ -0,0 +1,29 @@
+#include <stddef.h>
+#include "word_engine.h"
+#include "word_kernels.h"
+
+#define WL 4
+#include "word_engine_impl.h"
+#undef WL
+
+#define WL 5
+#include "word_engine_impl.h"
+#undef WL
+
+#define WL 6
+#include "word_engine_impl.h"
+#undef WL
+
+static const WordEngine *const engines[MAX_WORD_LENGTH + 1] = {
+    [4] = &engine_4,
+    [5] = &engine_5,
+    [6] = &engine_6,
+};
+
+// Returns the specialized kernels for length, or NULL if it is not supported
+const WordEngine *word_engine_for(int length)
+{
+  if (length < MIN_WORD_LENGTH || length > MAX_WORD_LENGTH)
+    return NULL;
+  return engines[length];
+}
@@ -0,0 +1,31 @@
+#ifndef WORD_ENGINE_H
+#define WORD_ENGINE_H
+
+#include <stdint.h>
+#include "database.h"
+
+// Each letter takes 5 bits ('a' = 1 ... 'z' = 26), so a key of 0 never names a
+// word. Keys are uint32, which caps the word length at 6 letters (30 bits); see
+// MIN_WORD_LENGTH / MAX_WORD_LENGTH in database.h.
+#define LETTER_BITS 5
+#define LETTER_MASK 0x1Fu
+
+// Kernels specialized for one word length, generated from word_engine_impl.h
+typedef struct WordEngine
+{
+  int length;
+  uint32_t (*pack)(const char *word); // 0 unless exactly length lowercase letters
+  void (*unpack)(uint32_t key, char *word);
+  int (*first)(uint32_t key); // Letter index (0-25) of the first letter
+  void (*distances)(const uint32_t *keys, int count, uint32_t key, uint8_t *distances);
+} WordEngine;
+
+const WordEngine *word_engine_for(int length);
+
+// Letter index (0-25) of the last letter; the same for every length
+static inline int word_key_last(uint32_t key)
+{
+  return (int)(key & LETTER_MASK) - 1;
+}
+
+#endif
@@ -0,0 +1,77 @@
+// Template for one word length. Included by word_engine.c once per length with
+// WL defined; every loop over letters is written out so the generated kernels
+// have no length loop.
+
+#define WE_JOIN(a, b) a##b
+#define WE_NAME(name, length) WE_JOIN(name, length)
+#define WE_FN(name) WE_NAME(name, WL)
+
+// bit 0 of each of the WL letter fields
+#define WE_FIELD_LOW_BITS ((uint32_t)((1ull << (LETTER_BITS * WL)) - 1) / LETTER_MASK)
+
+#define WE_PACK_LETTER(i)                                \
+  if (word[i] < 'a' || word[i] > 'z')                    \
+    return 0;                                            \
+  key = (key << LETTER_BITS) | (uint32_t)(word[i] - 'a' + 1);
+
+#define WE_UNPACK_LETTER(i) \
+  word[i] = (char)('a' + ((key >> (LETTER_BITS * (WL - 1 - (i)))) & LETTER_MASK) - 1);
+
+// First letter in the highest bits, so keys sort in the same order as the words
+static uint32_t WE_FN(pack_)(const char *word)
+{
+  uint32_t key = 0;
+  WE_PACK_LETTER(0)
+  WE_PACK_LETTER(1)
+  WE_PACK_LETTER(2)
+  WE_PACK_LETTER(3)
+#if WL > 4
+  WE_PACK_LETTER(4)
+#endif
+#if WL > 5
+  WE_PACK_LETTER(5)
+#endif
+  if (word[WL] != '\0')
+    return 0;
+  return key;
+}
+
+static void WE_FN(unpack_)(uint32_t key, char *word)
+{
+  WE_UNPACK_LETTER(0)
+  WE_UNPACK_LETTER(1)
+  WE_UNPACK_LETTER(2)
+  WE_UNPACK_LETTER(3)
+#if WL > 4
+  WE_UNPACK_LETTER(4)
+#endif
+#if WL > 5
+  WE_UNPACK_LETTER(5)
+#endif
+  word[WL] = '\0';
+}
+
+static int WE_FN(first_)(uint32_t key)
+{
+  return (int)(key >> (LETTER_BITS * (WL - 1))) - 1;
+}
+
+static void WE_FN(distances_)(const uint32_t *keys, int count, uint32_t key, uint8_t *distances)
+{
+  word_distances(keys, count, key, WE_FIELD_LOW_BITS, distances);
+}
+
+static const WordEngine WE_FN(engine_) = {
+    .length = WL,
+    .pack = WE_FN(pack_),
+    .unpack = WE_FN(unpack_),
+    .first = WE_FN(first_),
+    .distances = WE_FN(distances_),
+};
+
+#undef WE_JOIN
+#undef WE_NAME
+#undef WE_FN
+#undef WE_FIELD_LOW_BITS
+#undef WE_PACK_LETTER
+#undef WE_UNPACK_LETTER
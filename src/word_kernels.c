@@ -0,0 +1,200 @@
+#include "word_kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WORD_KERNELS_X86 1
+#endif
+
+// Hamming distance between packed words = number of 5-bit letter fields that
+// differ. Fold each field's bits into its lowest bit, keep only the fields the
+// word length uses (low_bits), then add up to six flags.
+
+// Returns the index of the first key equal to key, or -1
+static int find_scalar(const uint32_t *keys, int count, uint32_t key)
+{
+  for (int i = 0; i < count; i++)
+  {
+    if (keys[i] == key)
+      return i;
+  }
+  return -1;
+}
+
+static void distances_scalar(const uint32_t *keys, int count, uint32_t key, uint32_t low_bits, uint8_t *distances)
+{
+  for (int i = 0; i < count; i++)
+  {
+    uint32_t x = keys[i] ^ key;
+    x = (x | (x >> 1) | (x >> 2) | (x >> 3) | (x >> 4)) & low_bits;
+    distances[i] = (uint8_t)((x + (x >> 5) + (x >> 10) + (x >> 15) + (x >> 20) + (x >> 25)) & 7);
+  }
+}
+
+#ifdef __SSE2__
+// 8 keys per iteration, two 4-lane compares
+static int find_sse2(const uint32_t *keys, int count, uint32_t key)
+{
+  __m128i needle = _mm_set1_epi32((int)key);
+  int i = 0;
+  for (; i + 8 <= count; i += 8)
+  {
+    __m128i a = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(keys + i)), needle);
+    __m128i b = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(keys + i + 4)), needle);
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(a)) | (_mm_movemask_ps(_mm_castsi128_ps(b)) << 4);
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+  int rest = find_scalar(keys + i, count - i, key);
+  return rest < 0 ? -1 : i + rest;
+}
+
+static inline __m128i distance4_sse2(const uint32_t *keys, __m128i needle, __m128i low_bits)
+{
+  __m128i d = _mm_xor_si128(_mm_loadu_si128((const __m128i *)keys), needle);
+  __m128i x = _mm_or_si128(_mm_or_si128(d, _mm_srli_epi32(d, 1)), _mm_or_si128(_mm_srli_epi32(d, 2), _mm_srli_epi32(d, 3)));
+  x = _mm_and_si128(_mm_or_si128(x, _mm_srli_epi32(d, 4)), low_bits);
+  __m128i sum = _mm_add_epi32(_mm_add_epi32(x, _mm_srli_epi32(x, 5)), _mm_add_epi32(_mm_srli_epi32(x, 10), _mm_srli_epi32(x, 15)));
+  sum = _mm_add_epi32(sum, _mm_add_epi32(_mm_srli_epi32(x, 20), _mm_srli_epi32(x, 25)));
+  return _mm_and_si128(sum, _mm_set1_epi32(7));
+}
+
+// 8 keys per iteration, narrowed to bytes with two packs
+static void distances_sse2(const uint32_t *keys, int count, uint32_t key, uint32_t field_low_bits, uint8_t *distances)
+{
+  __m128i needle = _mm_set1_epi32((int)key);
+  __m128i low_bits = _mm_set1_epi32((int)field_low_bits);
+  int i = 0;
+  for (; i + 8 <= count; i += 8)
+  {
+    __m128i a = distance4_sse2(keys + i, needle, low_bits);
+    __m128i b = distance4_sse2(keys + i + 4, needle, low_bits);
+    __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_setzero_si128());
+    _mm_storel_epi64((__m128i *)(distances + i), bytes);
+  }
+  distances_scalar(keys + i, count - i, key, field_low_bits, distances + i);
+}
+#endif
+
+#ifdef WORD_KERNELS_X86
+// 16 keys per iteration, two 8-lane compares
+__attribute__((target("avx2"))) static int find_avx2(const uint32_t *keys, int count, uint32_t key)
+{
+  __m256i needle = _mm256_set1_epi32((int)key);
+  int i = 0;
+  for (; i + 16 <= count; i += 16)
+  {
+    __m256i a = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(keys + i)), needle);
+    __m256i b = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(keys + i + 8)), needle);
+    int mask = _mm256_movemask_ps(_mm256_castsi256_ps(a)) | (_mm256_movemask_ps(_mm256_castsi256_ps(b)) << 8);
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+  int rest = find_scalar(keys + i, count - i, key);
+  return rest < 0 ? -1 : i + rest;
+}
+
+__attribute__((target("avx2"))) static inline __m256i distance8_avx2(const uint32_t *keys, __m256i needle, __m256i low_bits)
+{
+  __m256i d = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)keys), needle);
+  __m256i x = _mm256_or_si256(_mm256_or_si256(d, _mm256_srli_epi32(d, 1)), _mm256_or_si256(_mm256_srli_epi32(d, 2), _mm256_srli_epi32(d, 3)));
+  x = _mm256_and_si256(_mm256_or_si256(x, _mm256_srli_epi32(d, 4)), low_bits);
+  __m256i sum = _mm256_add_epi32(_mm256_add_epi32(x, _mm256_srli_epi32(x, 5)), _mm256_add_epi32(_mm256_srli_epi32(x, 10), _mm256_srli_epi32(x, 15)));
+  sum = _mm256_add_epi32(sum, _mm256_add_epi32(_mm256_srli_epi32(x, 20), _mm256_srli_epi32(x, 25)));
+  return _mm256_and_si256(sum, _mm256_set1_epi32(7));
+}
+
+// 16 keys per iteration. packs works per 128-bit lane, so the 16-bit result is
+// put back in order with a cross-lane permute before the final byte pack.
+__attribute__((target("avx2"))) static void distances_avx2(const uint32_t *keys, int count, uint32_t key, uint32_t field_low_bits, uint8_t *distances)
+{
+  __m256i needle = _mm256_set1_epi32((int)key);
+  __m256i low_bits = _mm256_set1_epi32((int)field_low_bits);
+  int i = 0;
+  for (; i + 16 <= count; i += 16)
+  {
+    __m256i a = distance8_avx2(keys + i, needle, low_bits);
+    __m256i b = distance8_avx2(keys + i + 8, needle, low_bits);
+    __m256i words = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+    __m128i bytes = _mm_packus_epi16(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1));
+    _mm_storeu_si128((__m128i *)(distances + i), bytes);
+  }
+  distances_scalar(keys + i, count - i, key, field_low_bits, distances + i);
+}
+
+static int has_avx2(void)
+{
+  static int cached = -1;
+  if (cached == -1)
+  {
+    __builtin_cpu_init();
+    cached = __builtin_cpu_supports("avx2") ? 1 : 0;
+  }
+  return cached;
+}
+#endif
+
+int word_find(const uint32_t *keys, int count, uint32_t key)
+{
+#ifdef WORD_KERNELS_X86
+  if (has_avx2())
+    return find_avx2(keys, count, key);
+#endif
+#ifdef __SSE2__
+  return find_sse2(keys, count, key);
+#else
+  return find_scalar(keys, count, key);
+#endif
+}
+
+// distances[i] = number of letters in which keys[i] differs from key.
+// field_low_bits has bit 0 of each letter field set (see word_engine_impl.h).
+void word_distances(const uint32_t *keys, int count, uint32_t key, uint32_t field_low_bits, uint8_t *distances)
+{
+#ifdef WORD_KERNELS_X86
+  if (has_avx2())
+  {
+    distances_avx2(keys, count, key, field_low_bits, distances);
+    return;
+  }
+#endif
+#ifdef __SSE2__
+  distances_sse2(keys, count, key, field_low_bits, distances);
+#else
+  distances_scalar(keys, count, key, field_low_bits, distances);
+#endif
+}
+
+const char *word_kernels_name(void)
+{
+#ifdef WORD_KERNELS_X86
+  if (has_avx2())
+    return "avx2";
+#endif
+#ifdef __SSE2__
+  return "sse2";
+#else
+  return "scalar";
+#endif
+}
+
+// avx2 goes last so that it can be left out when the CPU lacks it
+static const WordKernels kernel_list[] = {
+    {"scalar", find_scalar, distances_scalar},
+#ifdef __SSE2__
+    {"sse2", find_sse2, distances_sse2},
+#endif
+#ifdef WORD_KERNELS_X86
+    {"avx2", find_avx2, distances_avx2},
+#endif
+};
+
+int word_kernels_list(const WordKernels **kernels)
+{
+  int count = (int)(sizeof(kernel_list) / sizeof(kernel_list[0]));
+#ifdef WORD_KERNELS_X86
+  if (!has_avx2())
+    count--;
+#endif
+  *kernels = kernel_list;
+  return count;
+}
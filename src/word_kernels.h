@@ -0,0 +1,25 @@
+#ifndef WORD_KERNELS_H
+#define WORD_KERNELS_H
+
+#include <stdint.h>
+
+// Batch kernels over packed word keys (see word_engine.h).
+// x86 builds use AVX2 when the CPU has it and SSE2 otherwise; other targets
+// use the scalar loop.
+
+int word_find(const uint32_t *keys, int count, uint32_t key);
+void word_distances(const uint32_t *keys, int count, uint32_t key, uint32_t field_low_bits, uint8_t *distances);
+const char *word_kernels_name(void);
+
+// One implementation of the kernels above, for tools/wordcheck.c
+typedef struct
+{
+  const char *name;
+  int (*find)(const uint32_t *keys, int count, uint32_t key);
+  void (*distances)(const uint32_t *keys, int count, uint32_t key, uint32_t field_low_bits, uint8_t *distances);
+} WordKernels;
+
+// Every implementation this build and CPU can run, scalar first. Returns the count.
+int word_kernels_list(const WordKernels **kernels);
+
+#endif